@@ -0,0 +1,409 @@
+/*
+ * Host benchmarks. Build and run with:
+ *
+ *   gcc -O2 -o bench bench.c src/hotp.c src/base32.c src/uri.c \
+ *       src/hash/[a-z]*.c src/libc.c \
+ *       -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc && ./bench
+ *
+ * Add -mssse3 or -mavx2 to measure the vector base32 codecs.
+ */
+
+#include "src/hotp.h"
+#include "src/base32.h"
+#include "src/uri.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIT "cycles"
+static uint64_t ticks(void) { return __rdtsc(); }
+#else
+#define UNIT "ns"
+static uint64_t
+ticks(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+#define ROUNDS 20000
+#define BASE32_BYTES (1 << 20)
+#define BASE32_ROUNDS 50
+#define URI_ROUNDS 200
+#define CORPUS 4096
+
+#if defined(__AVX2__)
+#define BASE32_PATH "avx2"
+#elif defined(__SSSE3__)
+#define BASE32_PATH "ssse3"
+#else
+#define BASE32_PATH "table"
+#endif
+
+static const hash_type types[] = {
+  HASH_TYPE_MD5, HASH_TYPE_SHA1, HASH_TYPE_SHA224,
+  HASH_TYPE_SHA256, HASH_TYPE_SHA384, HASH_TYPE_SHA512,
+};
+
+static void
+bench_hotp(hash_type type, uint8_t digits)
+{
+  hotp_kernel kernel = hotp_kernel_find(type, digits);
+  const uint8_t key[20] = "12345678901234567890";
+  uint64_t generic, special;
+  char code[9];
+  uint64_t start;
+
+  start = ticks();
+  for (uint64_t i = 0; i < ROUNDS; i++)
+    hotp(type, digits, key, sizeof(key), i, code, sizeof(code));
+  generic = (ticks() - start) / ROUNDS;
+
+  start = ticks();
+  for (uint64_t i = 0; i < ROUNDS; i++)
+    kernel(key, sizeof(key), i, code);
+  special = (ticks() - start) / ROUNDS;
+
+  printf("hotp %-6s %u digits: %8llu %s/code generic, %8llu kernel (%.2fx)\n",
+         hash_type_name(type), digits, (unsigned long long) generic, UNIT,
+         (unsigned long long) special, (double) generic / special);
+}
+
+static double
+seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+rate(size_t bytes, double start)
+{
+  return bytes * (double) BASE32_ROUNDS / (seconds() - start) / 1e9;
+}
+
+static void
+bench_base32(void)
+{
+  static uint8_t data[BASE32_BYTES];
+  static uint8_t back[BASE32_BYTES];
+  static char text[(BASE32_BYTES * 8 + 4) / 5 + 1];
+  static char grouped[sizeof(text) / 4 * 5 + 5];
+  double encode, decode, spaced;
+  size_t len = 0;
+  double start;
+  int n;
+
+  srand(1);
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = rand();
+
+  start = seconds();
+  for (int r = 0; r < BASE32_ROUNDS; r++)
+    n = base32_encode(data, sizeof(data), text, sizeof(text));
+  encode = rate(sizeof(data), start);
+
+  start = seconds();
+  for (int r = 0; r < BASE32_ROUNDS; r++)
+    base32_decode(text, back, sizeof(back));
+  decode = rate(n, start);
+
+  // Secrets are often written in groups of four, which the vector path
+  // leaves to the table.
+  for (int i = 0; i < n; i += 4)
+    len += sprintf(&grouped[len], "%.4s ", &text[i]);
+
+  start = seconds();
+  for (int r = 0; r < BASE32_ROUNDS; r++)
+    base32_decode(grouped, back, sizeof(back));
+  spaced = rate(len, start);
+
+  if (memcmp(back, data, sizeof(data)) != 0)
+    printf("base32 round trip failed!\n");
+
+  printf("base32 %-6s: %6.2f GB/s encode, %6.2f GB/s decode, "
+         "%6.2f GB/s decode grouped\n", BASE32_PATH, encode, decode, spaced);
+}
+
+/* Heap allocations, counted by wrapping the allocator. */
+
+static size_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+  allocs++;
+  return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+  allocs++;
+  return __real_realloc(ptr, size);
+}
+
+/*
+ * A reproducible corpus of otpauth URIs: every algorithm, both types and a
+ * spread of periods, labels up to the field size with plenty of escapes and
+ * UTF-8, and secrets from 1 to 64 bytes, sometimes in lower case or groups.
+ */
+
+static char corpus[CORPUS][512];
+static size_t corpus_len[CORPUS];
+static char secrets[CORPUS][128];
+
+static uint32_t seed = 2463534242;
+
+static uint32_t
+rnd(uint32_t n)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % n;
+}
+
+static size_t
+escape(char *out, const char *in, size_t len)
+{
+  static const char hex[] = "0123456789ABCDEF0123456789abcdef";
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = in[i];
+    bool plain = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                 (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_';
+
+    // Some encoders escape more than they must; mix the hex case too.
+    if (plain && rnd(8) != 0) {
+      out[n++] = c;
+    } else {
+      uint8_t lower = rnd(2) * 16;
+      out[n++] = '%';
+      out[n++] = hex[lower + (c >> 4)];
+      out[n++] = hex[lower + (c & 15)];
+    }
+  }
+
+  return n;
+}
+
+static size_t
+label(char *out, size_t max, bool colons)
+{
+  static const char *pieces[] = {
+    "a", "e", "o", "n", "x", "Q", "7", ".", "-", "_", " ", "@", "+", "&",
+    "=", "/", "?", "#", "%", "\xc3\xa9", "\xc3\xbc", "\xe6\x97\xa5",
+    "\xf0\x9f\x94\x91", ":",
+  };
+  const size_t n = sizeof(pieces) / sizeof(*pieces) - !colons;
+  char raw[64];
+  size_t len = 0;
+  size_t want = rnd(max) + 1;
+
+  while (len < want) {
+    const char *p = pieces[rnd(n)];
+    size_t l = strlen(p);
+
+    if (len + l > sizeof(raw))
+      break;
+    memcpy(&raw[len], p, l);
+    len += l;
+  }
+
+  return escape(out, raw, len);
+}
+
+static void
+build_corpus(void)
+{
+  static const char *algorithms[] = {
+    "md5", "SHA1", "sha224", "SHA256", "Sha384", "SHA512",
+  };
+  static const uint8_t periods[] = { 15, 30, 30, 30, 60, 90, 120, 255 };
+  static const uint8_t sizes[] = { 10, 16, 20, 20, 32, 64 };
+
+  for (size_t i = 0; i < CORPUS; i++) {
+    char *u = corpus[i];
+    bool hotp = rnd(4) == 0;
+    uint8_t key[64];
+    char issuer[256];
+    size_t ilen = 0;
+    size_t klen;
+    size_t n;
+
+    klen = rnd(4) == 0 ? rnd(64) + 1 : sizes[rnd(sizeof(sizes))];
+    for (size_t j = 0; j < klen; j++)
+      key[j] = rnd(256);
+    base32_encode(key, klen, secrets[i], sizeof(secrets[i]));
+
+    // Lower case, or spaced out in groups of four.
+    if (rnd(4) == 0) {
+      for (char *c = secrets[i]; *c; c++)
+        *c |= *c >= 'A' && *c <= 'Z' ? 0x20 : 0;
+    }
+
+    n = sprintf(u, "otpauth://%s/", hotp ? "hotp" : "totp");
+    if (rnd(4) != 0) {
+      ilen = label(issuer, 40, false);
+      memcpy(&u[n], issuer, ilen);
+      n += ilen;
+      n += sprintf(&u[n], rnd(2) ? ":" : "%%3A");
+    }
+    n += label(&u[n], 60, true);
+
+    n += sprintf(&u[n], "?secret=");
+    for (size_t j = 0; secrets[i][j]; j++) {
+      if (j > 0 && j % 4 == 0 && klen % 3 == 0)
+        n += sprintf(&u[n], "%%20");
+      u[n++] = secrets[i][j];
+    }
+
+    if (ilen > 0 && rnd(2)) {
+      n += sprintf(&u[n], "&issuer=");
+      memcpy(&u[n], issuer, ilen);
+      n += ilen;
+    }
+
+    n += sprintf(&u[n], "&algorithm=%s&digits=%d",
+                 algorithms[rnd(sizeof(algorithms) / sizeof(*algorithms))],
+                 rnd(2) ? 6 : 8);
+    if (hotp)
+      n += sprintf(&u[n], "&counter=%u%09u", rnd(1000), rnd(1000000000));
+    else
+      n += sprintf(&u[n], "&period=%d", periods[rnd(sizeof(periods))]);
+
+    corpus_len[i] = n;
+  }
+}
+
+static bool
+parse(const char *uri, size_t len, token *t)
+{
+  uri_parser p;
+
+  uri_init(&p, t);
+  uri_feed(&p, uri, len);
+  return uri_finish(&p);
+}
+
+static void
+bench_parse(void)
+{
+  size_t bytes = 0, secret = 0, before;
+  double start, parsed, decoded;
+  uint8_t key[64];
+  token t;
+
+  for (size_t i = 0; i < CORPUS; i++) {
+    if (!parse(corpus[i], corpus_len[i], &t))
+      printf("corpus URI %zu doesn't parse!\n", i);
+    bytes += corpus_len[i];
+    secret += strlen(secrets[i]);
+  }
+
+  before = allocs;
+  start = seconds();
+  for (int r = 0; r < URI_ROUNDS; r++) {
+    for (size_t i = 0; i < CORPUS; i++)
+      parse(corpus[i], corpus_len[i], &t);
+  }
+  parsed = seconds() - start;
+
+  printf("parse  %5d URIs, %3zu B mean: %6.2f M URIs/s, %4.0f MB/s, "
+         "%.2f allocations/URI\n", CORPUS, bytes / CORPUS,
+         (double) URI_ROUNDS * CORPUS / parsed / 1e6,
+         (double) URI_ROUNDS * bytes / parsed / 1e6,
+         (double) (allocs - before) / URI_ROUNDS / CORPUS);
+
+  before = allocs;
+  start = seconds();
+  for (int r = 0; r < URI_ROUNDS; r++) {
+    for (size_t i = 0; i < CORPUS; i++)
+      base32_decode(secrets[i], key, sizeof(key));
+  }
+  decoded = seconds() - start;
+
+  printf("base32 %5d keys, %3zu B mean: %6.2f M keys/s, %4.0f MB/s, "
+         "%.2f allocations/key\n", CORPUS, secret / CORPUS,
+         (double) URI_ROUNDS * CORPUS / decoded / 1e6,
+         (double) URI_ROUNDS * secret / decoded / 1e6,
+         (double) (allocs - before) / URI_ROUNDS / CORPUS);
+}
+
+static void
+bench_uri(void)
+{
+  static token tokens[CORPUS];
+  static char out[CORPUS][512];
+  static size_t lens[CORPUS];
+  double format, parsed;
+  size_t bytes = 0;
+  double start;
+  token back;
+
+  for (size_t i = 0; i < CORPUS; i++)
+    parse(corpus[i], corpus_len[i], &tokens[i]);
+
+  // Serialize each token, then parse it straight back.
+  start = seconds();
+  for (int r = 0; r < URI_ROUNDS; r++) {
+    for (size_t i = 0; i < CORPUS; i++)
+      lens[i] = uri_format(&tokens[i], out[i], sizeof(out[i]));
+  }
+  format = seconds() - start;
+
+  start = seconds();
+  for (int r = 0; r < URI_ROUNDS; r++) {
+    for (size_t i = 0; i < CORPUS; i++)
+      parse(out[i], lens[i], &back);
+  }
+  parsed = seconds() - start;
+
+  for (size_t i = 0; i < CORPUS; i++) {
+    bytes += lens[i] * (size_t) URI_ROUNDS;
+    if (!parse(out[i], lens[i], &back) || back.seclen != tokens[i].seclen ||
+        memcmp(back.secret, tokens[i].secret, back.seclen) != 0)
+      printf("uri round trip failed!\n");
+  }
+
+  printf("round trip: %.2f M URIs/s, %.0f MB/s format, %.0f MB/s parse\n",
+         (double) URI_ROUNDS * CORPUS / (format + parsed) / 1e6,
+         bytes / format / 1e6, bytes / parsed / 1e6);
+}
+
+int
+main()
+{
+  build_corpus();
+  bench_parse();
+  bench_uri();
+  bench_base32();
+
+  for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++) {
+    bench_hotp(types[i], 6);
+    bench_hotp(types[i], 8);
+  }
+
+  return 0;
+}
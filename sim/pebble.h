@@ -0,0 +1,167 @@
+/*
+ * Host stand-ins for the parts of the Pebble SDK used by src/msg.c and
+ * src/token.c; implemented by sim/sim.c. Dictionaries use the SDK's wire
+ * layout, so replies can be serialized and read back exactly as on a watch.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct Window Window;
+
+enum {
+  APP_LOG_LEVEL_ERROR = 1,
+  APP_LOG_LEVEL_WARNING = 50,
+  APP_LOG_LEVEL_INFO = 100,
+  APP_LOG_LEVEL_DEBUG = 200,
+};
+
+void
+app_log(uint8_t level, const char *file, int line, const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
+
+#define APP_LOG(level, fmt, ...) \
+  app_log(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
+
+/* Time */
+
+uint16_t
+time_ms(time_t *tloc, uint16_t *out_ms);
+
+typedef struct AppTimer AppTimer;
+typedef void (*AppTimerCallback)(void *data);
+
+AppTimer *
+app_timer_register(uint32_t timeout_ms, AppTimerCallback callback,
+                   void *data);
+
+bool
+app_timer_reschedule(AppTimer *timer, uint32_t timeout_ms);
+
+void
+app_timer_cancel(AppTimer *timer);
+
+/* Storage */
+
+bool
+persist_exists(uint32_t key);
+
+int
+persist_read_data(uint32_t key, void *buffer, size_t size);
+
+int
+persist_write_data(uint32_t key, const void *data, size_t size);
+
+int
+persist_delete(uint32_t key);
+
+/* Dictionaries */
+
+typedef enum {
+  TUPLE_BYTE_ARRAY = 0,
+  TUPLE_CSTRING = 1,
+  TUPLE_UINT = 2,
+  TUPLE_INT = 3,
+} TupleType;
+
+typedef union {
+  uint8_t data[0];
+  char cstring[0];
+  uint8_t uint8;
+  uint16_t uint16;
+  uint32_t uint32;
+  int8_t int8;
+  int16_t int16;
+  int32_t int32;
+} __attribute__((packed)) TupleValue;
+
+typedef struct {
+  uint32_t key;
+  TupleType type:8;
+  uint16_t length;
+  TupleValue value[];
+} __attribute__((packed)) Tuple;
+
+typedef struct {
+  uint8_t count;
+  Tuple head[];
+} __attribute__((packed)) Dictionary;
+
+typedef struct {
+  Dictionary *dictionary;
+  const void *end;
+  Tuple *cursor;
+} DictionaryIterator;
+
+typedef enum {
+  DICT_OK = 0,
+  DICT_NOT_ENOUGH_STORAGE = 1 << 1,
+  DICT_INVALID_ARGS = 1 << 2,
+} DictionaryResult;
+
+uint32_t
+dict_calc_buffer_size(const uint8_t tuple_count, ...);
+
+DictionaryResult
+dict_write_begin(DictionaryIterator *iter, uint8_t *buffer, uint16_t size);
+
+DictionaryResult
+dict_write_data(DictionaryIterator *iter, uint32_t key, const uint8_t *data,
+                uint16_t size);
+
+DictionaryResult
+dict_write_cstring(DictionaryIterator *iter, uint32_t key, const char *cstring);
+
+DictionaryResult
+dict_write_int(DictionaryIterator *iter, uint32_t key, const void *integer,
+               uint8_t width, bool is_signed);
+
+DictionaryResult
+dict_write_uint8(DictionaryIterator *iter, uint32_t key, uint8_t value);
+
+DictionaryResult
+dict_write_uint16(DictionaryIterator *iter, uint32_t key, uint16_t value);
+
+DictionaryResult
+dict_write_uint32(DictionaryIterator *iter, uint32_t key, uint32_t value);
+
+uint32_t
+dict_write_end(DictionaryIterator *iter);
+
+Tuple *
+dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t *buffer,
+                            uint16_t size);
+
+Tuple *
+dict_read_first(DictionaryIterator *iter);
+
+Tuple *
+dict_read_next(DictionaryIterator *iter);
+
+Tuple *
+dict_find(const DictionaryIterator *iter, uint32_t key);
+
+/* AppMessage */
+
+typedef enum {
+  APP_MSG_OK = 0,
+  APP_MSG_SEND_TIMEOUT = 1 << 1,
+  APP_MSG_SEND_REJECTED = 1 << 2,
+  APP_MSG_NOT_CONNECTED = 1 << 3,
+  APP_MSG_BUSY = 1 << 6,
+} AppMessageResult;
+
+uint32_t
+app_message_inbox_size_maximum(void);
+
+AppMessageResult
+app_message_outbox_begin(DictionaryIterator **iterator);
+
+AppMessageResult
+app_message_outbox_send(void);
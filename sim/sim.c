@@ -0,0 +1,968 @@
+/*
+ * Provisioning simulator: drives on_message() in src/msg.c from a scripted
+ * phone over a lossy link, on a virtual clock, and reports what each token
+ * cost. Build and run with:
+ *
+ *   gcc -O2 -Isim -o simulate sim/sim.c src/msg.c src/sched.c src/token.c \
+ *       src/hotp.c src/base32.c src/libc.c src/pack.c src/uri.c src/tlv.c \
+ *       src/hash/[a-z]*.c \
+ *       -Wl,--wrap=malloc,--wrap=free,--wrap=time,--wrap=hash_spec_get
+ *   ./simulate -n 8 -f 64 -l 5 -d 2 -r 10
+ *
+ * The watch side is the real code; the phone follows the transfer protocol
+ * in src/msg.h: every fragment declares the length and carries a checksum,
+ * damaged or missing data is resent on NACK and after status queries, and
+ * a busy watch is retried after the time it asks for.
+ */
+
+#include <pebble.h>
+#include "../src/msg.h"
+#include "../src/token.h"
+#include "../src/base32.h"
+#include "../src/pack.h"
+#include "../src/hash/hash.h"
+#include "../src/hash/murmur3.h"
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#define EVENT_MAX  4096
+#define FRAME_MAX  1024 /* Largest dictionary on the link. */
+#define INBOX_MAX  512  /* app_message_inbox_size_maximum() */
+#define STORE_MAX  16
+#define CELL_MAX   256  /* PERSIST_DATA_MAX_LENGTH */
+#define RESEND_MAX 64
+#define RTO        300  /* Phone's milliseconds of silence before a query. */
+#define GIVE_UP    (10 * 60 * 1000)
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+static struct {
+  unsigned tokens;
+  unsigned frag;    /* Payload bytes per fragment. */
+  unsigned loss;    /* Percent of frames lost, each direction. */
+  unsigned dup;     /* Percent of frames delivered twice. */
+  unsigned reorder; /* Percent of frames held back up to 4x the latency. */
+  unsigned latency; /* One way, in milliseconds. */
+  unsigned gap;     /* Milliseconds between fragments from the phone. */
+  unsigned seed;
+  bool tlv;
+  bool packed;
+  bool verbose;
+} opt = { 8, 64, 0, 0, 0, 20, 5, 1, false, false, false };
+
+enum kind {
+  EV_TIMER,
+  EV_TO_WATCH,
+  EV_TO_PHONE,
+  EV_SENT,
+  EV_FAILED,
+  EV_PHONE,
+};
+
+struct event {
+  uint64_t at;
+  uint64_t seq;
+  enum kind kind;
+  bool live;
+  AppTimerCallback callback;
+  void *data;
+  uint16_t size;
+  uint8_t frame[FRAME_MAX];
+};
+
+struct range {
+  size_t offset;
+  size_t length;
+};
+
+struct result {
+  const char *status;
+  uint64_t elapsed;
+  size_t up;
+  size_t down;
+  size_t hashed;
+  unsigned frags;
+};
+
+static struct event events[EVENT_MAX];
+static uint64_t now;
+static uint64_t seq;
+static uint64_t rng;
+
+static size_t heap_live;
+static size_t heap_peak;
+static size_t heap_allocs;
+static size_t hash_bytes;
+static size_t bytes_up;
+static size_t bytes_down;
+static size_t overflows;
+
+static struct {
+  uint32_t key;
+  size_t size;
+  bool used;
+  uint8_t data[CELL_MAX];
+} store[STORE_MAX];
+
+static struct {
+  uint8_t buf[MSG_OUTBOX_SIZE];
+  DictionaryIterator iter;
+  bool busy;
+} outbox;
+
+static struct {
+  uint8_t payload[FRAME_MAX];
+  size_t size;
+  size_t length;  /* Declared; larger than size when packed. */
+  uint32_t key;
+  char hash[HASH_SIZE_MAX * 2 + 8];
+  uint32_t id;
+  size_t next;    /* First offset never sent. */
+  size_t acked;   /* Everything below this has arrived. */
+  size_t credit;
+  struct range resend[RESEND_MAX];
+  unsigned nresend;
+  uint64_t started;
+  uint64_t heard; /* Last reply, or last query. */
+  uint64_t resume; /* A busy watch asked us to wait until then. */
+  unsigned frags;
+  bool done;
+  struct result *result;
+} phone;
+
+/* Heap accounting, via -Wl,--wrap=malloc,--wrap=free */
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+void *
+__wrap_malloc(size_t size)
+{
+  size_t *p = __real_malloc(size + 16);
+
+  if (!p)
+    return NULL;
+
+  p[0] = size;
+  heap_live += size;
+  heap_peak = MAX(heap_peak, heap_live);
+  heap_allocs++;
+  return (uint8_t *) p + 16;
+}
+
+void
+__wrap_free(void *ptr)
+{
+  size_t *p;
+
+  if (!ptr)
+    return;
+
+  p = (size_t *) ((uint8_t *) ptr - 16);
+  heap_live -= p[0];
+  __real_free(p);
+}
+
+/* Hash work, via -Wl,--wrap=hash_spec_get */
+
+const hash_spec *__real_hash_spec_get(hash_type type);
+
+static void (*updates[HASH_TYPE_SHA512 + 1])(hash_ctx *, const void *, size_t);
+static hash_spec counted[HASH_TYPE_SHA512 + 1];
+
+#define COUNTED(type) \
+  static void \
+  update_ ## type(hash_ctx *ctx, const void *buf, size_t len) \
+  { \
+    hash_bytes += len; \
+    updates[type](ctx, buf, len); \
+  }
+
+COUNTED(HASH_TYPE_MD5)
+COUNTED(HASH_TYPE_SHA1)
+COUNTED(HASH_TYPE_SHA224)
+COUNTED(HASH_TYPE_SHA256)
+COUNTED(HASH_TYPE_SHA384)
+COUNTED(HASH_TYPE_SHA512)
+
+static void (*const counters[])(hash_ctx *, const void *, size_t) = {
+  [HASH_TYPE_MD5] = update_HASH_TYPE_MD5,
+  [HASH_TYPE_SHA1] = update_HASH_TYPE_SHA1,
+  [HASH_TYPE_SHA224] = update_HASH_TYPE_SHA224,
+  [HASH_TYPE_SHA256] = update_HASH_TYPE_SHA256,
+  [HASH_TYPE_SHA384] = update_HASH_TYPE_SHA384,
+  [HASH_TYPE_SHA512] = update_HASH_TYPE_SHA512,
+};
+
+const hash_spec *
+__wrap_hash_spec_get(hash_type type)
+{
+  const hash_spec *spec = __real_hash_spec_get(type);
+
+  if (!spec)
+    return NULL;
+
+  updates[type] = spec->update;
+  counted[type] = *spec;
+  counted[type].update = counters[type];
+  return &counted[type];
+}
+
+/* The virtual clock, via -Wl,--wrap=time */
+
+time_t
+__wrap_time(time_t *tloc)
+{
+  time_t t = now / 1000;
+
+  if (tloc)
+    *tloc = t;
+
+  return t;
+}
+
+uint16_t
+time_ms(time_t *tloc, uint16_t *out_ms)
+{
+  if (tloc)
+    *tloc = now / 1000;
+  if (out_ms)
+    *out_ms = now % 1000;
+  return now % 1000;
+}
+
+void
+app_log(uint8_t level, const char *file, int line, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (!opt.verbose)
+    return;
+
+  va_start(ap, fmt);
+  fprintf(stderr, "%8llu %s:%d ", (unsigned long long) now, file, line);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+}
+
+static uint32_t
+random32(void)
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (rng * 2685821657736338717ull) >> 32;
+}
+
+static bool
+chance(unsigned percent)
+{
+  return random32() % 100 < percent;
+}
+
+/* Events */
+
+static struct event *
+schedule(enum kind kind, uint64_t delay)
+{
+  for (size_t i = 0; i < EVENT_MAX; i++) {
+    if (events[i].live)
+      continue;
+
+    events[i].live = true;
+    events[i].kind = kind;
+    events[i].at = now + delay;
+    events[i].seq = seq++;
+    return &events[i];
+  }
+
+  fprintf(stderr, "Event queue overflow!\n");
+  exit(1);
+}
+
+static struct event *
+next_event(void)
+{
+  struct event *next = NULL;
+
+  for (size_t i = 0; i < EVENT_MAX; i++) {
+    if (!events[i].live)
+      continue;
+
+    if (!next || events[i].at < next->at ||
+        (events[i].at == next->at && events[i].seq < next->seq))
+      next = &events[i];
+  }
+
+  return next;
+}
+
+AppTimer *
+app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *data)
+{
+  struct event *ev = schedule(EV_TIMER, timeout_ms);
+
+  ev->callback = callback;
+  ev->data = data;
+  return (AppTimer *) ev;
+}
+
+bool
+app_timer_reschedule(AppTimer *timer, uint32_t timeout_ms)
+{
+  struct event *ev = (struct event *) timer;
+
+  if (!ev->live || ev->kind != EV_TIMER)
+    return false;
+
+  ev->at = now + timeout_ms;
+  return true;
+}
+
+void
+app_timer_cancel(AppTimer *timer)
+{
+  struct event *ev = (struct event *) timer;
+
+  if (ev->kind == EV_TIMER)
+    ev->live = false;
+}
+
+/* Storage */
+
+bool
+persist_exists(uint32_t key)
+{
+  for (size_t i = 0; i < STORE_MAX; i++) {
+    if (store[i].used && store[i].key == key)
+      return true;
+  }
+
+  return false;
+}
+
+int
+persist_read_data(uint32_t key, void *buffer, size_t size)
+{
+  for (size_t i = 0; i < STORE_MAX; i++) {
+    if (!store[i].used || store[i].key != key)
+      continue;
+
+    size = size < store[i].size ? size : store[i].size;
+    memcpy(buffer, store[i].data, size);
+    return size;
+  }
+
+  return -1;
+}
+
+int
+persist_write_data(uint32_t key, const void *data, size_t size)
+{
+  size_t free = STORE_MAX;
+
+  if (size > CELL_MAX)
+    return -1;
+
+  for (size_t i = 0; i < STORE_MAX; i++) {
+    if (store[i].used && store[i].key == key)
+      free = i;
+    else if (!store[i].used && free == STORE_MAX)
+      free = i;
+  }
+  if (free == STORE_MAX)
+    return -1;
+
+  store[free].used = true;
+  store[free].key = key;
+  store[free].size = size;
+  memcpy(store[free].data, data, size);
+  return size;
+}
+
+int
+persist_delete(uint32_t key)
+{
+  for (size_t i = 0; i < STORE_MAX; i++) {
+    if (store[i].used && store[i].key == key)
+      store[i].used = false;
+  }
+
+  return 0;
+}
+
+/* Dictionaries, in the SDK's layout */
+
+static Tuple *
+tuple_next(const Tuple *tuple)
+{
+  return (Tuple *) ((uint8_t *) tuple + sizeof(Tuple) + tuple->length);
+}
+
+uint32_t
+dict_calc_buffer_size(const uint8_t tuple_count, ...)
+{
+  uint32_t size = sizeof(Dictionary) + tuple_count * sizeof(Tuple);
+  va_list ap;
+
+  va_start(ap, tuple_count);
+  for (uint8_t i = 0; i < tuple_count; i++)
+    size += va_arg(ap, uint32_t);
+  va_end(ap);
+  return size;
+}
+
+DictionaryResult
+dict_write_begin(DictionaryIterator *iter, uint8_t *buffer, uint16_t size)
+{
+  if (size < sizeof(Dictionary))
+    return DICT_NOT_ENOUGH_STORAGE;
+
+  iter->dictionary = (Dictionary *) buffer;
+  iter->dictionary->count = 0;
+  iter->cursor = iter->dictionary->head;
+  iter->end = buffer + size;
+  return DICT_OK;
+}
+
+static DictionaryResult
+dict_write(DictionaryIterator *iter, uint32_t key, TupleType type,
+           const void *data, uint16_t size)
+{
+  Tuple *tuple = iter->cursor;
+
+  if ((uint8_t *) tuple + sizeof(Tuple) + size > (uint8_t *) iter->end)
+    return DICT_NOT_ENOUGH_STORAGE;
+
+  tuple->key = key;
+  tuple->type = type;
+  tuple->length = size;
+  memcpy(tuple->value->data, data, size);
+  iter->cursor = tuple_next(tuple);
+  iter->dictionary->count++;
+  return DICT_OK;
+}
+
+DictionaryResult
+dict_write_data(DictionaryIterator *iter, uint32_t key, const uint8_t *data,
+                uint16_t size)
+{
+  return dict_write(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult
+dict_write_cstring(DictionaryIterator *iter, uint32_t key, const char *cstring)
+{
+  return dict_write(iter, key, TUPLE_CSTRING, cstring, strlen(cstring) + 1);
+}
+
+DictionaryResult
+dict_write_int(DictionaryIterator *iter, uint32_t key, const void *integer,
+               uint8_t width, bool is_signed)
+{
+  if (width != 1 && width != 2 && width != 4)
+    return DICT_INVALID_ARGS;
+
+  return dict_write(iter, key, is_signed ? TUPLE_INT : TUPLE_UINT,
+                    integer, width);
+}
+
+DictionaryResult
+dict_write_uint8(DictionaryIterator *iter, uint32_t key, uint8_t value)
+{
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult
+dict_write_uint16(DictionaryIterator *iter, uint32_t key, uint16_t value)
+{
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult
+dict_write_uint32(DictionaryIterator *iter, uint32_t key, uint32_t value)
+{
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+uint32_t
+dict_write_end(DictionaryIterator *iter)
+{
+  iter->end = iter->cursor;
+  return (uint8_t *) iter->cursor - (uint8_t *) iter->dictionary;
+}
+
+Tuple *
+dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t *buffer,
+                            uint16_t size)
+{
+  iter->dictionary = (Dictionary *) buffer;
+  iter->end = buffer + size;
+  return dict_read_first(iter);
+}
+
+Tuple *
+dict_read_first(DictionaryIterator *iter)
+{
+  iter->cursor = iter->dictionary->head;
+  if (iter->dictionary->count == 0)
+    return NULL;
+
+  return iter->cursor;
+}
+
+Tuple *
+dict_read_next(DictionaryIterator *iter)
+{
+  iter->cursor = tuple_next(iter->cursor);
+  if ((uint8_t *) iter->cursor >= (uint8_t *) iter->end)
+    return NULL;
+
+  return iter->cursor;
+}
+
+Tuple *
+dict_find(const DictionaryIterator *iter, uint32_t key)
+{
+  Tuple *tuple = iter->dictionary->head;
+
+  for (uint8_t i = 0; i < iter->dictionary->count; i++) {
+    if (tuple->key == key)
+      return tuple;
+    tuple = tuple_next(tuple);
+  }
+
+  return NULL;
+}
+
+/* The link */
+
+// Sends a frame, perhaps losing, repeating or delaying it. True if it left.
+static bool
+transmit(enum kind kind, const uint8_t *frame, uint16_t size)
+{
+  unsigned copies = chance(opt.dup) ? 2 : 1;
+  bool delivered = false;
+
+  for (unsigned i = 0; i < copies; i++) {
+    uint64_t delay = opt.latency;
+    struct event *ev;
+
+    if (kind == EV_TO_WATCH)
+      bytes_up += size;
+    else
+      bytes_down += size;
+
+    if (chance(opt.loss))
+      continue;
+
+    if (chance(opt.reorder))
+      delay += random32() % (opt.latency * 4 + 1);
+
+    ev = schedule(kind, delay);
+    memcpy(ev->frame, frame, size);
+    ev->size = size;
+    delivered = true;
+  }
+
+  return delivered;
+}
+
+uint32_t
+app_message_inbox_size_maximum(void)
+{
+  return INBOX_MAX;
+}
+
+AppMessageResult
+app_message_outbox_begin(DictionaryIterator **iterator)
+{
+  if (outbox.busy)
+    return APP_MSG_BUSY;
+
+  dict_write_begin(&outbox.iter, outbox.buf, sizeof(outbox.buf));
+  *iterator = &outbox.iter;
+  return APP_MSG_OK;
+}
+
+AppMessageResult
+app_message_outbox_send(void)
+{
+  uint32_t size = dict_write_end(&outbox.iter);
+
+  if (outbox.busy)
+    return APP_MSG_BUSY;
+
+  // The phone's acknowledgement comes back one latency after delivery.
+  outbox.busy = true;
+  if (transmit(EV_TO_PHONE, outbox.buf, size))
+    schedule(EV_SENT, opt.latency * 2);
+  else
+    schedule(EV_FAILED, opt.latency * 2 + 200);
+
+  return APP_MSG_OK;
+}
+
+/* The phone */
+
+static void
+resend(size_t offset, size_t length)
+{
+  if (phone.nresend == RESEND_MAX)
+    return;
+
+  phone.resend[phone.nresend].offset = offset;
+  phone.resend[phone.nresend].length = length;
+  phone.nresend++;
+}
+
+static void
+send_fragment(size_t offset, size_t length)
+{
+  uint8_t frame[FRAME_MAX];
+  uint8_t data[FRAME_MAX];
+  DictionaryIterator iter;
+
+  memcpy(data, phone.payload + offset, length);
+  data[length] = '\0';
+
+  dict_write_begin(&iter, frame, sizeof(frame));
+  dict_write_cstring(&iter, KEY_HASH, phone.hash);
+  dict_write_uint32(&iter, KEY_ID, phone.id);
+  dict_write_uint32(&iter, KEY_OFFSET, offset);
+  dict_write_uint32(&iter, KEY_LENGTH, phone.length);
+  dict_write_uint32(&iter, KEY_CHECKSUM, murmur3_32(data, length));
+  if (phone.key != KEY_MESSAGE)
+    dict_write_data(&iter, phone.key, data, length);
+  else
+    dict_write_cstring(&iter, KEY_MESSAGE, (char *) data);
+
+  transmit(EV_TO_WATCH, frame, dict_write_end(&iter));
+  phone.frags++;
+}
+
+// A fragment-less message asks the watch which ranges are still missing.
+static void
+send_query(void)
+{
+  uint8_t frame[FRAME_MAX];
+  DictionaryIterator iter;
+
+  dict_write_begin(&iter, frame, sizeof(frame));
+  dict_write_cstring(&iter, KEY_HASH, phone.hash);
+  dict_write_uint32(&iter, KEY_ID, phone.id);
+  transmit(EV_TO_WATCH, frame, dict_write_end(&iter));
+}
+
+static void
+phone_tick(void)
+{
+  if (phone.done)
+    return;
+
+  if (now < phone.resume) {
+    // Still waiting out a busy reply.
+  } else if (phone.nresend > 0) {
+    struct range *r = &phone.resend[0];
+    size_t length = r->length < opt.frag ? r->length : opt.frag;
+
+    send_fragment(r->offset, length);
+    r->offset += length;
+    r->length -= length;
+    if (r->length == 0)
+      memmove(r, r + 1, --phone.nresend * sizeof(*r));
+  } else if (phone.next < phone.size &&
+             phone.next < phone.acked + phone.credit) {
+    size_t length = phone.size - phone.next;
+
+    length = length < opt.frag ? length : opt.frag;
+    send_fragment(phone.next, length);
+    phone.next += length;
+  } else if (now - phone.heard >= RTO) {
+    send_query();
+    phone.heard = now;
+  }
+
+  schedule(EV_PHONE, opt.gap);
+}
+
+static void
+phone_finish(const char *status)
+{
+  phone.done = true;
+  phone.result->status = status;
+  phone.result->elapsed = now - phone.started;
+}
+
+static void
+phone_receive(const uint8_t *frame, uint16_t size)
+{
+  DictionaryIterator iter;
+  Tuple *tuple;
+
+  dict_read_begin_from_buffer(&iter, frame, size);
+  tuple = dict_find(&iter, KEY_HASH);
+  if (phone.done || !tuple || strcmp(tuple->value->cstring, phone.hash) != 0)
+    return;
+
+  phone.heard = now;
+
+  if ((tuple = dict_find(&iter, KEY_SUCCESS))) {
+    if (tuple->value->uint8) {
+      phone_finish("added");
+    } else if ((tuple = dict_find(&iter, KEY_RETRY))) {
+      // The watch kept nothing; start over once it has room.
+      phone.next = phone.acked = phone.nresend = 0;
+      phone.resume = phone.heard = now + tuple->value->uint32;
+    } else {
+      tuple = dict_find(&iter, KEY_MESSAGE);
+      phone_finish(tuple ? tuple->value->cstring : "failed");
+    }
+    return;
+  }
+
+  if ((tuple = dict_find(&iter, KEY_NACK)))
+    resend(tuple->value->uint32, opt.frag);
+
+  if ((tuple = dict_find(&iter, KEY_ACK)))
+    phone.acked = MAX(phone.acked, tuple->value->uint32);
+
+  if ((tuple = dict_find(&iter, KEY_CREDIT)))
+    phone.credit = tuple->value->uint32;
+
+  // Missing ranges are little endian uint16 pairs; a zero length means all.
+  if ((tuple = dict_find(&iter, KEY_MISSING))) {
+    const uint8_t *data = tuple->value->data;
+
+    phone.nresend = 0;
+    for (uint16_t i = 0; i + 4 <= tuple->length; i += 4) {
+      const uint8_t *d = &data[i];
+      size_t offset = d[0] | d[1] << 8;
+      size_t length = d[2] | d[3] << 8;
+
+      if (offset >= phone.size)
+        continue;
+      if (length == 0 || offset + length > phone.size)
+        length = phone.size - offset;
+      resend(offset, length);
+    }
+  }
+}
+
+static size_t
+put_tlv(uint8_t *buf, size_t len, uint8_t tag, const void *value, size_t size)
+{
+  buf[len++] = tag;
+  buf[len++] = size;
+  memcpy(&buf[len], value, size);
+  return len + size;
+}
+
+static void
+phone_start(unsigned n, struct result *result)
+{
+  const hash_spec *spec = __real_hash_spec_get(HASH_TYPE_SHA1);
+  uint8_t ctx[512] __attribute__((aligned(16)));
+  uint8_t digest[HASH_SIZE_MAX];
+  char secret[64];
+  char issuer[32];
+  char name[32];
+  uint8_t key[20];
+
+  for (size_t i = 0; i < sizeof(key); i++)
+    key[i] = random32();
+  snprintf(issuer, sizeof(issuer), "Issuer%u", n);
+  snprintf(name, sizeof(name), "user%u@example.com", n);
+
+  memset(&phone, 0, sizeof(phone));
+  if (opt.tlv) {
+    uint8_t type = TOKEN_TYPE_TOTP;
+
+    phone.key = KEY_TOKEN;
+    phone.size = put_tlv(phone.payload, 0, TOKEN_TLV_TYPE, &type, 1);
+    phone.size = put_tlv(phone.payload, phone.size, TOKEN_TLV_ISSUER,
+                         issuer, strlen(issuer));
+    phone.size = put_tlv(phone.payload, phone.size, TOKEN_TLV_NAME,
+                         name, strlen(name));
+    phone.size = put_tlv(phone.payload, phone.size, TOKEN_TLV_SECRET,
+                         key, sizeof(key));
+  } else {
+    base32_encode(key, sizeof(key), secret, sizeof(secret));
+    phone.key = KEY_MESSAGE;
+    phone.size = snprintf((char *) phone.payload, sizeof(phone.payload),
+                          "otpauth://totp/%s:%s?secret=%s&issuer=%s"
+                          "&digits=6&period=30", issuer, name, secret, issuer);
+  }
+
+  // The digest always covers what the watch will parse.
+  spec->init((hash_ctx *) ctx);
+  spec->update((hash_ctx *) ctx, phone.payload, phone.size);
+  phone.length = phone.size;
+  if (opt.packed && phone.key == KEY_MESSAGE) {
+    char uri[FRAME_MAX];
+
+    memcpy(uri, phone.payload, phone.size);
+    phone.key = KEY_PACKED;
+    phone.size = pack(uri, phone.length, phone.payload,
+                      sizeof(phone.payload));
+  }
+
+  spec->finish((hash_ctx *) ctx, digest);
+  strcpy(phone.hash, "sha1:");
+  hash_to_hex(digest, spec->hash, phone.hash + 5);
+
+  phone.id = n + 1;
+  phone.credit = 2048;
+  phone.started = phone.heard = now;
+  phone.result = result;
+  schedule(EV_PHONE, 0);
+}
+
+/* Running it */
+
+static void
+run(struct result *result)
+{
+  DictionaryIterator iter;
+  struct event *ev;
+  bool changed;
+
+  while (!phone.done && (ev = next_event())) {
+    if (ev->at - phone.started > GIVE_UP) {
+      phone_finish("gave up");
+      break;
+    }
+
+    now = ev->at;
+    ev->live = false;
+
+    switch (ev->kind) {
+    case EV_TIMER:
+      ev->callback(ev->data);
+      break;
+    case EV_TO_WATCH:
+      // Like the watch, drop what doesn't fit in the inbox.
+      if (ev->size > app_message_inbox_size_maximum()) {
+        overflows++;
+        break;
+      }
+      dict_read_begin_from_buffer(&iter, ev->frame, ev->size);
+      on_message(&iter, &changed);
+      break;
+    case EV_TO_PHONE:
+      phone_receive(ev->frame, ev->size);
+      break;
+    case EV_SENT:
+      outbox.busy = false;
+      on_sent(&outbox.iter);
+      break;
+    case EV_FAILED:
+      outbox.busy = false;
+      on_failed(&outbox.iter, APP_MSG_SEND_TIMEOUT);
+      break;
+    case EV_PHONE:
+      phone_tick();
+      break;
+    }
+  }
+
+  // Stop pacing this token's fragments; the watch's own timers run on.
+  for (size_t i = 0; i < EVENT_MAX; i++) {
+    if (events[i].kind == EV_PHONE || events[i].kind == EV_TO_WATCH)
+      events[i].live = false;
+  }
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-n tokens] [-f fragment bytes] [-l loss %%] "
+          "[-d duplicate %%]\n          [-r reorder %%] [-L latency ms] "
+          "[-g gap ms] [-s seed] [-t | -z] [-v]\n", prog);
+  exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct result *results;
+  uint64_t total = 0;
+  uint64_t worst = 0;
+  size_t payload = 0;
+  unsigned added = 0;
+  msg_stats stats;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:f:l:d:r:L:g:s:tzv")) != -1) {
+    switch (c) {
+    case 'n': opt.tokens = atoi(optarg); break;
+    case 'f': opt.frag = atoi(optarg); break;
+    case 'l': opt.loss = atoi(optarg); break;
+    case 'd': opt.dup = atoi(optarg); break;
+    case 'r': opt.reorder = atoi(optarg); break;
+    case 'L': opt.latency = atoi(optarg); break;
+    case 'g': opt.gap = atoi(optarg); break;
+    case 's': opt.seed = atoi(optarg); break;
+    case 't': opt.tlv = true; break;
+    case 'z': opt.packed = true; break;
+    case 'v': opt.verbose = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (opt.tokens == 0 || opt.frag == 0 || opt.frag >= 512 || opt.gap == 0)
+    usage(argv[0]);
+
+  rng = opt.seed * 0x9e3779b97f4a7c15ull + 1;
+  results = __real_malloc(opt.tokens * sizeof(*results));
+  memset(results, 0, opt.tokens * sizeof(*results));
+
+  printf("%5s %-28s %8s %7s %7s %7s %6s\n", "token", "result", "ms",
+         "up B", "down B", "hash B", "frags");
+
+  for (unsigned i = 0; i < opt.tokens; i++) {
+    struct result *r = &results[i];
+    size_t up = bytes_up, down = bytes_down, hashed = hash_bytes;
+
+    // The store only holds TOKEN_MAX; empty it to keep adding.
+    if (token_count() >= TOKEN_MAX)
+      memset(store, 0, sizeof(store));
+
+    phone_start(i, r);
+    payload += phone.length;
+    run(r);
+
+    r->up = bytes_up - up;
+    r->down = bytes_down - down;
+    r->hashed = hash_bytes - hashed;
+    r->frags = phone.frags;
+    total += r->elapsed;
+    worst = MAX(worst, r->elapsed);
+    added += strcmp(r->status, "added") == 0;
+
+    printf("%5u %-28.28s %8llu %7zu %7zu %7zu %6u\n", i, r->status,
+           (unsigned long long) r->elapsed, r->up, r->down, r->hashed,
+           r->frags);
+  }
+
+  msg_get_stats(&stats);
+  printf("\n%u of %u tokens added in %llu ms (%llu ms mean, %llu ms worst)\n",
+         added, opt.tokens, (unsigned long long) total,
+         (unsigned long long) (total / opt.tokens),
+         (unsigned long long) worst);
+  printf("%zu B payload, %zu B up, %zu B down, %.0f payload B/s\n",
+         payload, bytes_up, bytes_down,
+         total ? payload * 1000.0 / total : 0.0);
+  printf("%zu B hashed (%.2f per payload byte)\n", hash_bytes,
+         payload ? (double) hash_bytes / payload : 0.0);
+  printf("%zu B peak heap, %zu allocations, %u B peak transfer budget\n",
+         heap_peak, heap_allocs, stats.peak);
+  printf("%u replies, %u retries, %u dropped, %u coalesced, %u busy, "
+         "%zu inbox overflows\n", (unsigned) stats.sent,
+         (unsigned) stats.retries, (unsigned) stats.dropped,
+         (unsigned) stats.coalesced, (unsigned) stats.busy, overflows);
+
+  __real_free(results);
+  return added == opt.tokens ? 0 : 1;
+}
@@ -17,36 +17,284 @@
 #include <string.h>
 #include "base32.h"
 
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <stdbool.h>
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define XX 0xff // Invalid
+#define SP 0xfe // Separator, skipped
+
+// Base32 digit of each character, with the commonly mistyped characters
+// ('0', '1' and '8') read as the letters they look like.
+static const uint8_t decodeTable[256] = {
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, SP, SP, XX, XX, SP, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    SP, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, SP, XX, XX,
+    14, 11, 26, 27, 28, 29, 30, 31,  1, XX, XX, XX, XX, XX, XX, XX,
+    XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+    XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+#if defined(__SSSE3__)
+// The vector paths handle blocks of plain base32 digits; anything else
+// (separators, errors, a partial block) is left to the table.
+
+static bool
+decode16(const char *in, uint8_t *out)
+{
+    const __m128i c = _mm_loadu_si128((const __m128i *) in);
+    const __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    const __m128i letter = _mm_and_si128(
+        _mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), l));
+    const __m128i digit = _mm_and_si128(
+        _mm_cmpgt_epi8(c, _mm_set1_epi8('1')),
+        _mm_cmpgt_epi8(_mm_set1_epi8('8'), c));
+    const __m128i zero = _mm_cmpeq_epi8(c, _mm_set1_epi8('0'));
+    const __m128i one = _mm_cmpeq_epi8(c, _mm_set1_epi8('1'));
+    const __m128i eight = _mm_cmpeq_epi8(c, _mm_set1_epi8('8'));
+    __m128i v;
+
+    v = _mm_or_si128(_mm_or_si128(letter, digit),
+                     _mm_or_si128(_mm_or_si128(zero, one), eight));
+    if (_mm_movemask_epi8(v) != 0xffff)
+        return false;
+
+    v = _mm_or_si128(_mm_and_si128(letter, _mm_sub_epi8(l, _mm_set1_epi8('a'))),
+                     _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('2' - 26))));
+    v = _mm_or_si128(v, _mm_and_si128(zero, _mm_set1_epi8('O' - 'A')));
+    v = _mm_or_si128(v, _mm_and_si128(one, _mm_set1_epi8('L' - 'A')));
+    v = _mm_or_si128(v, _mm_and_si128(eight, _mm_set1_epi8('B' - 'A')));
+
+    // Pack 5 bit digits into 10 bit pairs, 20 bit quads and 40 bit octets,
+    // then put the octets' bytes in order.
+    v = _mm_maddubs_epi16(v, _mm_set1_epi16(0x0120));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00010400));
+    v = _mm_or_si128(
+        _mm_slli_epi64(_mm_and_si128(v, _mm_set1_epi64x(0xffffffff)), 20),
+        _mm_srli_epi64(v, 32));
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8,
+                                          -1, -1, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *) out, v);
+    return true;
+}
+
+static void
+encode16(const uint8_t *in, char *out)
+{
+    const __m128i even = _mm_set_epi32(0, -1, 0, -1);
+    __m128i v = _mm_loadu_si128((const __m128i *) in);
+    __m128i high;
+
+    // Unpack each 40 bit octet into 20 bit quads, 10 bit pairs and 5 bit
+    // digits, the first digit in the lowest byte.
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, -1, 4, 3, 2, -1,
+                                          7, 6, 5, -1, 9, 8, 7, -1));
+    v = _mm_or_si128(_mm_and_si128(even, _mm_srli_epi32(v, 4)),
+                     _mm_andnot_si128(even, _mm_and_si128(
+                         v, _mm_set1_epi32(0xfffff))));
+    v = _mm_or_si128(_mm_srli_epi32(v, 10),
+                     _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x3ff)), 16));
+    v = _mm_or_si128(_mm_srli_epi16(v, 5),
+                     _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x1f)), 8));
+
+    high = _mm_cmpgt_epi8(v, _mm_set1_epi8(25));
+    v = _mm_add_epi8(v, _mm_set1_epi8('A'));
+    v = _mm_sub_epi8(v, _mm_and_si128(high, _mm_set1_epi8('A' - '2' + 26)));
+    _mm_storeu_si128((__m128i *) out, v);
+}
+#endif
+
+#if defined(__AVX2__)
+// Two of the blocks above, one in each 128 bit lane.
+
+static bool
+decode32(const char *in, uint8_t *out)
+{
+    const __m256i c = _mm256_loadu_si256((const __m256i *) in);
+    const __m256i l = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    const __m256i letter = _mm256_and_si256(
+        _mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), l));
+    const __m256i digit = _mm256_and_si256(
+        _mm256_cmpgt_epi8(c, _mm256_set1_epi8('1')),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('8'), c));
+    const __m256i zero = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('0'));
+    const __m256i one = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('1'));
+    const __m256i eight = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('8'));
+    __m256i v;
+
+    v = _mm256_or_si256(_mm256_or_si256(letter, digit),
+                        _mm256_or_si256(_mm256_or_si256(zero, one), eight));
+    if (_mm256_movemask_epi8(v) != -1)
+        return false;
+
+    v = _mm256_or_si256(
+        _mm256_and_si256(letter, _mm256_sub_epi8(l, _mm256_set1_epi8('a'))),
+        _mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('2' - 26))));
+    v = _mm256_or_si256(v, _mm256_and_si256(zero, _mm256_set1_epi8('O' - 'A')));
+    v = _mm256_or_si256(v, _mm256_and_si256(one, _mm256_set1_epi8('L' - 'A')));
+    v = _mm256_or_si256(v, _mm256_and_si256(eight, _mm256_set1_epi8('B' - 'A')));
+
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi16(0x0120));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00010400));
+    v = _mm256_or_si256(
+        _mm256_slli_epi64(_mm256_and_si256(v, _mm256_set1_epi64x(0xffffffff)), 20),
+        _mm256_srli_epi64(v, 32));
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+        4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1,
+        4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *) (out + 10), _mm256_extracti128_si256(v, 1));
+    return true;
+}
+
+static void
+encode32(const uint8_t *in, char *out)
+{
+    const __m256i even = _mm256_set_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) in)),
+        _mm_loadu_si128((const __m128i *) (in + 10)), 1);
+    __m256i high;
+
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+        2, 1, 0, -1, 4, 3, 2, -1, 7, 6, 5, -1, 9, 8, 7, -1,
+        2, 1, 0, -1, 4, 3, 2, -1, 7, 6, 5, -1, 9, 8, 7, -1));
+    v = _mm256_or_si256(_mm256_and_si256(even, _mm256_srli_epi32(v, 4)),
+                        _mm256_andnot_si256(even, _mm256_and_si256(
+                            v, _mm256_set1_epi32(0xfffff))));
+    v = _mm256_or_si256(_mm256_srli_epi32(v, 10),
+                        _mm256_slli_epi32(_mm256_and_si256(
+                            v, _mm256_set1_epi32(0x3ff)), 16));
+    v = _mm256_or_si256(_mm256_srli_epi16(v, 5),
+                        _mm256_slli_epi16(_mm256_and_si256(
+                            v, _mm256_set1_epi16(0x1f)), 8));
+
+    high = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25));
+    v = _mm256_add_epi8(v, _mm256_set1_epi8('A'));
+    v = _mm256_sub_epi8(v, _mm256_and_si256(high, _mm256_set1_epi8('A' - '2' + 26)));
+    _mm256_storeu_si256((__m256i *) out, v);
+}
+#endif
+
+#if defined(__SSSE3__)
+// Decodes whole blocks of 16 digits into 10 bytes each, while the input
+// holds nothing else and the output has room; returns the digits used.
+static int
+decodeBlocks(const char *in, int length, uint8_t *out, int bufSize)
+{
+    int n = 0;
+
+#if defined(__AVX2__)
+    while (length - n >= 32 && bufSize - n / 16 * 10 >= 32 &&
+           decode32(in + n, out + n / 16 * 10))
+        n += 32;
+#endif
+    while (length - n >= 16 && bufSize - n / 16 * 10 >= 16 &&
+           decode16(in + n, out + n / 16 * 10))
+        n += 16;
+
+    return n;
+}
+
+// Encodes whole blocks of 10 bytes into 16 digits each; returns the bytes
+// used. The vector loads read up to 16 bytes past each block's start.
+static int
+encodeBlocks(const uint8_t *in, int length, char *out, int bufSize)
+{
+    int n = 0;
+
+#if defined(__AVX2__)
+    while (length - n >= 26 && bufSize - n / 10 * 16 >= 32) {
+        encode32(in + n, out + n / 10 * 16);
+        n += 20;
+    }
+#endif
+    while (length - n >= 16 && bufSize - n / 10 * 16 >= 16) {
+        encode16(in + n, out + n / 10 * 16);
+        n += 10;
+    }
+
+    return n;
+}
+#endif
+
 int
 base32_decode(const char *encoded, uint8_t *result, int bufSize)
 {
-    int buffer = 0;
-    int bitsLeft = 0;
-    int count = 0;
+    base32_ctx ctx;
+    int count;
+
+    base32_decode_init(&ctx);
+    count = base32_decode_update(&ctx, encoded, strlen(encoded),
+                                 result, bufSize);
+    if (count >= 0 && count < bufSize)
+        result[count] = '\000';
 
-    for (const char *ptr = encoded; count < bufSize && *ptr; ++ptr) {
-        char ch = *ptr;
-        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '-')
-            continue;
-        buffer <<= 5;
-        
-        // Deal with commonly mistyped characters
-        if (ch == '0')
-            ch = 'O';
-        else if (ch == '1')
-            ch = 'L';
-        else if (ch == '8')
-            ch = 'B';
-        
-        // Look up one base32 digit
-        if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z'))
-            ch = (ch & 0x1F) - 1;
-        else if (ch >= '2' && ch <= '7')
-            ch -= '2' - 26;
-        else
+    return count;
+}
+
+void
+base32_decode_init(base32_ctx *ctx)
+{
+    ctx->buffer = 0;
+    ctx->bitsLeft = 0;
+    ctx->count = 0;
+}
+
+int
+base32_decode_update(base32_ctx *ctx, const char *encoded, int length,
+                     uint8_t *result, int bufSize)
+{
+    unsigned buffer = ctx->buffer;
+    int bitsLeft = ctx->bitsLeft;
+    int count = ctx->count;
+
+#if defined(__SSSE3__)
+    int retry = 0;
+#endif
+
+    for (int i = 0; count < bufSize && i < length; ) {
+#if defined(__SSSE3__)
+        // Blocks only line up with the output between bytes. After a block
+        // that isn't all digits, give the table a block's worth before
+        // trying again, or separated groups would be tried every few digits.
+        if (bitsLeft == 0 && i >= retry) {
+            int n = decodeBlocks(encoded + i, length - i,
+                                 result + count, bufSize - count);
+            i += n;
+            count += n / 16 * 10;
+            retry = i + 16;
+            if (count >= bufSize || i >= length)
+                break;
+        }
+#endif
+
+        uint8_t ch = decodeTable[(uint8_t) encoded[i++]];
+        if (ch >= 32) {
+            if (ch == SP)
+                continue;
             return -1;
-        
-        buffer |= ch;
+        }
+
+        buffer = buffer << 5 | ch;
         bitsLeft += 5;
         if (bitsLeft >= 8) {
             result[count++] = buffer >> (bitsLeft - 8);
@@ -54,22 +302,19 @@ base32_decode(const char *encoded, uint8_t *result, int bufSize)
         }
     }
 
-    if (count < bufSize)
-        result[count] = '\000';
-
+    ctx->buffer = buffer;
+    ctx->bitsLeft = bitsLeft;
+    ctx->count = count;
     return count;
 }
 
-int
-base32_encode(const uint8_t *data, int length, char *result, int bufSize)
+static int
+encode(const uint8_t *data, int length, char *result, int bufSize)
 {
     int count = 0;
 
-    if (length < 0 || length > (1 << 28))
-        return -1;
-
     if (length > 0) {
-        int buffer = data[0];
+        unsigned buffer = data[0];
         int next = 1;
         int bitsLeft = 8;
 
@@ -97,3 +342,20 @@ base32_encode(const uint8_t *data, int length, char *result, int bufSize)
 
     return count;
 }
+
+int
+base32_encode(const uint8_t *data, int length, char *result, int bufSize)
+{
+    int next = 0;
+    int count;
+
+    if (length < 0 || length > (1 << 28))
+        return -1;
+
+#if defined(__SSSE3__)
+    next = encodeBlocks(data, length, result, bufSize);
+#endif
+    count = next / 10 * 16;
+    return count + encode(data + next, length - next,
+                          result + count, bufSize - count);
+}
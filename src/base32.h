@@ -28,8 +28,23 @@
 #pragma once
 #include <stdint.h>
 
+typedef struct {
+    unsigned buffer;
+    int bitsLeft;
+    int count;
+} base32_ctx;
+
 int
 base32_decode(const char *encoded, uint8_t *result, int bufSize);
 
+// Incremental decoding, for input that arrives in pieces. Each call decodes
+// the next length characters and returns the output bytes so far or -1.
+void
+base32_decode_init(base32_ctx *ctx);
+
+int
+base32_decode_update(base32_ctx *ctx, const char *encoded, int length,
+                     uint8_t *result, int bufSize);
+
 int
 base32_encode(const uint8_t *data, int length, char *result, int bufSize);
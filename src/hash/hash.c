@@ -61,6 +61,21 @@ tohex(uint8_t b)
   return 'a' + b - 10;
 }
 
+static int8_t
+fromhex(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
 hash_type
 hash_type_find(const char *name)
 {
@@ -106,3 +121,18 @@ hash_to_hex(const uint8_t *hash, size_t hashsize, char *hex)
     hex[i * 2 + 1] = tohex(hash[i]);
   }
 }
+
+bool
+hash_from_hex(const char *hex, uint8_t *hash, size_t hashsize)
+{
+  for (size_t i = 0; i < hashsize; i++) {
+    int8_t u = fromhex(hex[i * 2 + 0]);
+    int8_t l = u < 0 ? -1 : fromhex(hex[i * 2 + 1]);
+    if (l < 0)
+      return false;
+
+    hash[i] = u << 4 | l;
+  }
+
+  return hex[hashsize * 2] == '\0';
+}
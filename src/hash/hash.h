@@ -21,6 +21,9 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#define HASH_SIZE_MAX 64
 
 #define HASH_TYPE_DEFINE(name, hsize, bsize) \
   hash_spec hash_spec_ ## name = { \
@@ -67,3 +70,6 @@ hash_spec_get(hash_type type);
 
 void
 hash_to_hex(const uint8_t *hash, size_t hashsize, char *hex);
+
+bool
+hash_from_hex(const char *hex, uint8_t *hash, size_t hashsize);
@@ -22,6 +22,56 @@
 #include "hash.h"
 
 #include <stdbool.h>
+#include <string.h>
+
+/*
+ * Defines a fixed-size HMAC for a single hash, name_hmac(). It calls the
+ * hash functions directly rather than through hash_spec and uses no heap.
+ * The output buffer must be hsize bytes.
+ */
+#define HMAC_DEFINE(name, hsize, bsize) \
+  HMAC_DECLARE(name) \
+  { \
+    uint8_t block[bsize]; \
+    uint8_t inner[hsize]; \
+    hash_ctx ctx; \
+    \
+    if (keylen > bsize) { \
+      name ## _init(&ctx); \
+      name ## _update(&ctx, key, keylen); \
+      name ## _finish(&ctx, block); \
+      keylen = hsize; \
+    } else { \
+      memcpy(block, key, keylen); \
+    } \
+    memset(&block[keylen], 0, bsize - keylen); \
+    \
+    for (size_t i = 0; i < bsize; i++) \
+      block[i] ^= 0x36; \
+    name ## _init(&ctx); \
+    name ## _update(&ctx, block, bsize); \
+    name ## _update(&ctx, msg, msglen); \
+    name ## _finish(&ctx, inner); \
+    \
+    for (size_t i = 0; i < bsize; i++) \
+      block[i] ^= 0x36 ^ 0x5c; \
+    name ## _init(&ctx); \
+    name ## _update(&ctx, block, bsize); \
+    name ## _update(&ctx, inner, hsize); \
+    name ## _finish(&ctx, out); \
+  }
+
+#define HMAC_DECLARE(name) \
+  void \
+  name ## _hmac(const void *key, size_t keylen, \
+                const void *msg, size_t msglen, uint8_t *out)
+
+HMAC_DECLARE(md5);
+HMAC_DECLARE(sha1);
+HMAC_DECLARE(sha224);
+HMAC_DECLARE(sha256);
+HMAC_DECLARE(sha384);
+HMAC_DECLARE(sha512);
 
 bool
 hmac(hash_type type,
@@ -21,6 +21,7 @@
 /* This file adapted from: http://port70.net/~nsz/crypt/ */
 /* Original code public domain md5 implementation based on rfc1321 and libtomcrypt */
 #include "md5.h"
+#include "hmac.h"
 #include <string.h>
 
 static uint32_t rol(uint32_t n, int k) { return (n << k) | (n >> (32-k)); }
@@ -184,4 +185,6 @@ md5_finish(hash_ctx *ctx, uint8_t *hash)
   }
 }
 
+HMAC_DEFINE(md5, MD5_SIZE_HASH, MD5_SIZE_BLOCK)
+
 HASH_TYPE_DEFINE(md5, MD5_SIZE_HASH, MD5_SIZE_BLOCK);
@@ -56,7 +56,7 @@ uint32_t murmur3_32(const void *data, size_t nbytes) {
     const uint32_t c2 = 0x1b873593;
 
     const int nblocks = nbytes / 4;
-    const uint32_t *blocks = (const uint32_t *) (data);
+    const uint8_t *blocks = (const uint8_t *) (data);
     const uint8_t *tail = ((const uint8_t *) data) + (nblocks * 4);
 
     uint32_t h = 0;
@@ -64,7 +64,9 @@ uint32_t murmur3_32(const void *data, size_t nbytes) {
     int i;
     uint32_t k;
     for (i = 0; i < nblocks; i++) {
-        k = blocks[i];
+        // Data may lie at any address; assemble each block little endian.
+        const uint8_t *b = &blocks[i * 4];
+        k = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
 
         k *= c1;
         k = (k << 15) | (k >> (32 - 15));
@@ -99,3 +101,55 @@ uint32_t murmur3_32(const void *data, size_t nbytes) {
 
     return h;
 }
+
+#define C1 0xcc9e2d51
+#define C2 0x1b873593
+
+static inline uint32_t murmur3_scramble(uint32_t k) {
+    k *= C1;
+    k = (k << 15) | (k >> (32 - 15));
+    k *= C2;
+    return k;
+}
+
+void murmur3_init(murmur3_ctx *ctx) {
+    ctx->h = 0;
+    ctx->tail = 0;
+    ctx->nbytes = 0;
+}
+
+/* Blocks are assembled little endian, as murmur3_32() reads them. */
+void murmur3_update(murmur3_ctx *ctx, const void *data, size_t nbytes) {
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < nbytes; i++) {
+        ctx->tail |= (uint32_t) bytes[i] << ((ctx->nbytes & 3) * 8);
+        if ((++ctx->nbytes & 3) != 0)
+            continue;
+
+        ctx->h ^= murmur3_scramble(ctx->tail);
+        ctx->h = (ctx->h << 13) | (ctx->h >> (32 - 13));
+        ctx->h = (ctx->h * 5) + 0xe6546b64;
+        ctx->tail = 0;
+    }
+}
+
+uint32_t murmur3_finish(const murmur3_ctx *ctx) {
+    uint32_t h = ctx->h;
+
+    if (ctx->nbytes == 0)
+        return 0;
+
+    if (ctx->nbytes & 3)
+        h ^= murmur3_scramble(ctx->tail);
+
+    h ^= ctx->nbytes;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
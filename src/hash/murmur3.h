@@ -26,8 +26,20 @@
  * POSSIBILITY OF SUCH DAMAGE.
  *****************************************************************************/
 
+#pragma once
 #include <stdint.h>
 #include <stddef.h>
 
 uint32_t murmur3_32(const void *data, size_t nbytes);
 
+/* Incremental form; gives the same result as murmur3_32() on the concatenation. */
+typedef struct {
+    uint32_t h;
+    uint32_t tail;
+    uint32_t nbytes;
+} murmur3_ctx;
+
+void murmur3_init(murmur3_ctx *ctx);
+void murmur3_update(murmur3_ctx *ctx, const void *data, size_t nbytes);
+uint32_t murmur3_finish(const murmur3_ctx *ctx);
+
@@ -21,6 +21,7 @@
 /* This file adapted from: http://port70.net/~nsz/crypt/ */
 /* Original code public domain sha1 implementation based on rfc3174 and libtomcrypt */
 #include "sha1.h"
+#include "hmac.h"
 #include <string.h>
 
 static uint32_t rol(uint32_t n, int k) { return (n << k) | (n >> (32-k)); }
@@ -172,4 +173,6 @@ sha1_finish(hash_ctx *ctx, uint8_t *hash)
   }
 }
 
+HMAC_DEFINE(sha1, SHA1_SIZE_HASH, SHA1_SIZE_BLOCK)
+
 HASH_TYPE_DEFINE(sha1, SHA1_SIZE_HASH, SHA1_SIZE_BLOCK);
@@ -19,6 +19,7 @@
  */
 
 #include "sha224.h"
+#include "hmac.h"
 #include <string.h>
 
 void
@@ -48,4 +49,6 @@ void sha224_finish(hash_ctx *ctx, uint8_t *hash)
   memcpy(hash, tmp, SHA224_SIZE_HASH);
 }
 
+HMAC_DEFINE(sha224, SHA224_SIZE_HASH, SHA224_SIZE_BLOCK)
+
 HASH_TYPE_DEFINE(sha224, SHA224_SIZE_HASH, SHA224_SIZE_BLOCK);
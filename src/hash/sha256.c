@@ -21,6 +21,7 @@
 /* This file adapted from: http://port70.net/~nsz/crypt/ */
 /* Original code public domain sha256 implementation based on fips180-3 */
 #include "sha256.h"
+#include "hmac.h"
 #include <string.h>
 
 static uint32_t ror(uint32_t n, int k) { return (n >> k) | (n << (32-k)); }
@@ -182,4 +183,6 @@ sha256_finish(hash_ctx *ctx, uint8_t *hash)
   }
 }
 
+HMAC_DEFINE(sha256, SHA256_SIZE_HASH, SHA256_SIZE_BLOCK)
+
 HASH_TYPE_DEFINE(sha256, SHA256_SIZE_HASH, SHA256_SIZE_BLOCK);
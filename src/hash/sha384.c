@@ -19,6 +19,7 @@
  */
 
 #include "sha384.h"
+#include "hmac.h"
 #include <string.h>
 
 void
@@ -49,4 +50,6 @@ sha384_finish(hash_ctx *ctx, uint8_t *hash)
   memcpy(hash, tmp, SHA384_SIZE_HASH);
 }
 
+HMAC_DEFINE(sha384, SHA384_SIZE_HASH, SHA384_SIZE_BLOCK)
+
 HASH_TYPE_DEFINE(sha384, SHA384_SIZE_HASH, SHA384_SIZE_BLOCK);
@@ -22,6 +22,7 @@
 /* Original code public domain sha512 implementation based on fips180-3 */
 /* >=2^64 bits messages are not supported (about 2000 peta bytes) */
 #include "sha512.h"
+#include "hmac.h"
 #include <string.h>
 
 static uint64_t ror(uint64_t n, int k) { return (n >> k) | (n << (64-k)); }
@@ -200,4 +201,6 @@ sha512_finish(hash_ctx *ctx, uint8_t *hash)
   }
 }
 
+HMAC_DEFINE(sha512, SHA512_SIZE_HASH, SHA512_SIZE_BLOCK)
+
 HASH_TYPE_DEFINE(sha512, SHA512_SIZE_HASH, SHA512_SIZE_BLOCK);
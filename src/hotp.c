@@ -0,0 +1,142 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hotp.h"
+#include "hash/hmac.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HOTP_DEFINE(name, hsize, digits, div) \
+  static void \
+  hotp_ ## name ## _ ## digits(const uint8_t *key, size_t keylen, \
+                               uint64_t counter, char *code) \
+  { \
+    uint8_t digest[hsize]; \
+    uint8_t msg[8]; \
+    \
+    encode(counter, msg); \
+    name ## _hmac(key, keylen, msg, sizeof(msg), digest); \
+    format(truncate(digest, hsize) % div, digits, code); \
+  }
+
+#define HOTP_DEFINE_ALL(name, hsize) \
+  HOTP_DEFINE(name, hsize, 6, 1000000) \
+  HOTP_DEFINE(name, hsize, 8, 100000000)
+
+static const char pairs[] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+// Network byte order
+static inline void
+encode(uint64_t counter, uint8_t *msg)
+{
+  for (int i = 7; i >= 0; i--) {
+    msg[i] = counter;
+    counter >>= 8;
+  }
+}
+
+static inline uint32_t
+truncate(const uint8_t *digest, size_t dlen)
+{
+  uint32_t binary;
+  uint32_t off = digest[dlen - 1] & 0xf;
+  binary  = (digest[off + 0] & 0x7f) << 0x18;
+  binary |= (digest[off + 1] & 0xff) << 0x10;
+  binary |= (digest[off + 2] & 0xff) << 0x08;
+  binary |= (digest[off + 3] & 0xff) << 0x00;
+  return binary;
+}
+
+// Two digits per division; digits must be even.
+static inline void
+format(uint32_t num, uint8_t digits, char *code)
+{
+  code[digits] = '\0';
+  for (int i = digits; i > 0; i -= 2) {
+    const char *p = &pairs[num % 100 * 2];
+    code[i - 1] = p[1];
+    code[i - 2] = p[0];
+    num /= 100;
+  }
+}
+
+HOTP_DEFINE_ALL(md5, 16)
+HOTP_DEFINE_ALL(sha1, 20)
+HOTP_DEFINE_ALL(sha224, 28)
+HOTP_DEFINE_ALL(sha256, 32)
+HOTP_DEFINE_ALL(sha384, 48)
+HOTP_DEFINE_ALL(sha512, 64)
+
+static const hotp_kernel kernels[][2] = {
+  { hotp_md5_6,    hotp_md5_8 },
+  { hotp_sha1_6,   hotp_sha1_8 },
+  { hotp_sha224_6, hotp_sha224_8 },
+  { hotp_sha256_6, hotp_sha256_8 },
+  { hotp_sha384_6, hotp_sha384_8 },
+  { hotp_sha512_6, hotp_sha512_8 },
+};
+
+hotp_kernel
+hotp_kernel_find(hash_type type, uint8_t digits)
+{
+  if (type == HASH_TYPE_UNKNOWN || type > sizeof(kernels) / sizeof(*kernels))
+    return NULL;
+
+  switch (digits) {
+  case 6:
+    return kernels[type - 1][0];
+  case 8:
+    return kernels[type - 1][1];
+  default:
+    return NULL;
+  }
+}
+
+bool
+hotp(hash_type type, uint8_t digits, const uint8_t *key, size_t keylen,
+     uint64_t counter, char *code, size_t size)
+{
+  uint8_t *digest;
+  uint8_t msg[8];
+  char tmpl[16];
+  size_t dlen;
+
+  encode(counter, msg);
+
+  // Create digits divisor
+  uint32_t div = 1;
+  for (int i = digits; i > 0; i--)
+    div *= 10;
+
+  // Create the HMAC
+  if (!hmac(type, key, keylen, msg, sizeof(msg), &digest, &dlen))
+    return false;
+
+  snprintf(tmpl, sizeof(tmpl), "%%0%ud", (unsigned) digits);
+  snprintf(code, size, tmpl, (unsigned) (truncate(digest, dlen) % div));
+
+  free(digest);
+  return true;
+}
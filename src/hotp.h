@@ -0,0 +1,38 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include "hash/hash.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Writes a zero padded code of a fixed number of digits, plus a NUL. */
+typedef void (*hotp_kernel)(const uint8_t *key, size_t keylen,
+                            uint64_t counter, char *code);
+
+/* Returns a specialized kernel, or NULL if there is none for this pair. */
+hotp_kernel
+hotp_kernel_find(hash_type type, uint8_t digits);
+
+/* The generic implementation; works for any hash and digit count. */
+bool
+hotp(hash_type type, uint8_t digits, const uint8_t *key, size_t keylen,
+     uint64_t counter, char *code, size_t size);
@@ -20,27 +20,53 @@
 
 #include "ui/menu.h"
 #include "msg.h"
+#include "sched.h"
 
 static void
-msg_received(DictionaryIterator *iterator, void *context)
+reload(void *context)
 {
-  bool added;
-  
-  on_message(iterator, &added);
-  
-  if (!added)
-    return;
-
   // Success. Rewind to the top of the stack and reload.
   while (window_stack_get_top_window() != context)
     window_stack_pop(true);
   menu_reload(context);
 }
 
+static void
+msg_received(DictionaryIterator *iterator, void *context)
+{
+  bool changed;
+  
+  on_message(iterator, &changed);
+  
+  if (changed)
+    reload(context);
+}
+
+static void
+msg_sent(DictionaryIterator *iterator, void *context)
+{
+  on_sent(iterator);
+}
+
+static void
+msg_failed(DictionaryIterator *iterator, AppMessageResult reason,
+           void *context)
+{
+  on_failed(iterator, reason);
+}
+
+static void
+msg_dropped(AppMessageResult reason, void *context)
+{
+  APP_LOG(APP_LOG_LEVEL_WARNING, "Message dropped: %d!", reason);
+}
+
 int
 main(void)
 {
   AppMessageResult rslt;
+  sched_stats stats;
+  msg_stats replies;
   Window *top;
   
   top = menu_create();
@@ -51,17 +77,42 @@ main(void)
 
   app_message_set_context(top);
   app_message_register_inbox_received(msg_received);
+  app_message_register_outbox_sent(msg_sent);
+  app_message_register_outbox_failed(msg_failed);
+  app_message_register_inbox_dropped(msg_dropped);
+  msg_set_changed_handler(reload, top);
   rslt = app_message_open(app_message_inbox_size_maximum(),
-                          app_message_outbox_size_maximum());
+                          MSG_OUTBOX_SIZE);
   if (rslt != APP_MSG_OK) {
     APP_LOG(APP_LOG_LEVEL_ERROR, "Failed to open message boxes: %d!", rslt);
     return 1;
   }
 
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Message boxes use %u bytes; %u free",
+          (unsigned) (app_message_inbox_size_maximum() + MSG_OUTBOX_SIZE),
+          (unsigned) heap_bytes_free());
+
   window_stack_push(top, true);
 
   app_event_loop();
-     
+
+  sched_get_stats(&stats);
+  APP_LOG(APP_LOG_LEVEL_DEBUG,
+          "Scheduler: %u slices, %u steps, %u overruns, %u ms worst, "
+          "%u peak depth", (unsigned) stats.slices, (unsigned) stats.steps,
+          (unsigned) stats.overruns, (unsigned) stats.worst, stats.peak);
+
+  msg_get_stats(&replies);
+  APP_LOG(APP_LOG_LEVEL_DEBUG,
+          "Replies: %u sent, %u retries, %u dropped, %u coalesced, "
+          "%u ms mean, %u ms worst latency", (unsigned) replies.sent,
+          (unsigned) replies.retries, (unsigned) replies.dropped,
+          (unsigned) replies.coalesced,
+          (unsigned) (replies.sent ? replies.latency / replies.sent : 0),
+          (unsigned) replies.worst);
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Transfers: %u turned away, %u bytes peak",
+          (unsigned) replies.busy, replies.peak);
+
   app_message_deregister_callbacks();
   window_destroy(top);
   return 0;
@@ -22,18 +22,92 @@
 #include "ui/menu.h"
 #include "token.h"
 #include "libc.h"
+#include "hash/murmur3.h"
+#include "pack.h"
+#include "sched.h"
 
-#define MSG_MAX     5
-#define MSG_TIMEOUT 10
+#define MSG_MAX       5
+#define MSG_TIMEOUT   30   /* Seconds of inactivity before a slot is dropped. */
+#define MSG_WINDOW    2048 /* Most bytes a sender may have unacknowledged. */
+#define MSG_ACK_EVERY 4    /* Fragments between windowed acknowledgements. */
+#define MSG_BUDGET    4096 /* Most bytes held by all transfers together. */
+#define MSG_RETRY     1000 /* Milliseconds a busy sender should wait. */
+#define MSG_SWEEP     5    /* Seconds between sweeps for idle transfers. */
+#define MSG_BATCH     TOKEN_MAX /* Most tokens parsed from one transfer. */
+#define RANGE_MAX     8
+#define REPLY_MAX     6    /* Replies queued behind the one in flight. */
+#define REPLY_SIZE    MSG_OUTBOX_SIZE
+#define REPLY_TRIES   3
+#define REPLY_RETRY   100  /* Milliseconds before resending a failed reply. */
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+struct range {
+  uint16_t start;
+  uint16_t end;
+};
+
+/* A batch being parsed, one token per step; see provision(). */
+struct batch {
+  size_t n;                 /* Tokens in the transfer. */
+  size_t pos;               /* Next byte to parse. */
+  size_t i;                 /* Next token. */
+  uint8_t m;                /* Tokens parsed. */
+  uint8_t index[MSG_BATCH]; /* Which token each parsed one is. */
+  uint8_t *results;
+  token *tokens;
+};
 
 struct message {
+  uint32_t id;           /* KEY_ID, or else the murmur3 of the hash. */
   char *hash;
+  uint32_t key;          /* KEY_MESSAGE, KEY_TOKEN (TLV) or KEY_PACKED. */
   char *buffer;
   size_t size;
-  time_t start;
+  size_t hashed;         /* Bytes of buffer absorbed into ctx. */
+  bool declared;         /* The sender declared the length up front. */
+  const hash_spec *spec;
+  hash_ctx *ctx;         /* Running hash, then scratch space, then digest. */
+  time_t touched;
+  struct range ranges[RANGE_MAX]; /* Received bytes; sorted and merged. */
+  uint8_t nranges;
+  uint8_t fragments;
+  uint32_t started;      /* Milliseconds; for throughput. */
+  size_t charged;        /* Bytes counted against MSG_BUDGET. */
+  pack_state unpack;     /* For KEY_PACKED; ranges count packed bytes. */
+  struct batch *batch;   /* Set while its tokens are being stored. */
+};
+
+struct reply {
+  uint8_t buf[REPLY_SIZE]; /* A serialized dictionary. */
+  uint16_t size;
+  uint8_t tries;
+  uint32_t queued;         /* Milliseconds; for latency. */
 };
 
 struct message messages[MSG_MAX];
+static AppTimer *sweeper;
+static size_t reserved;
+
+// Replies wait here until the outbox is free; the head is sent first.
+static struct {
+  struct reply replies[REPLY_MAX];
+  DictionaryIterator iter;
+  AppTimer *timer;
+  uint8_t head;
+  uint8_t count;
+  bool sending;
+} outbox;
+
+static msg_stats stats;
+
+static struct {
+  msg_changed handler;
+  void *context;
+} notify;
+
+static bool provision(void *data);
 
 static void
 message_free(struct message *msg)
@@ -41,28 +115,249 @@ message_free(struct message *msg)
   if (!msg)
     return;
 
+  if (msg->batch) {
+    sched_cancel(provision, msg);
+    free(msg->batch->results);
+    free(msg->batch->tokens);
+    free(msg->batch);
+  }
+
+  reserved -= msg->charged;
   free(msg->hash);
   free(msg->buffer);
+  free(msg->ctx);
   memset(msg, 0, sizeof(struct message));
 }
 
+static uint32_t
+now_ms(void)
+{
+  uint16_t ms;
+  time_t s;
+
+  time_ms(&s, &ms);
+  return s * 1000 + ms;
+}
+
+static struct reply *
+reply_at(uint8_t i)
+{
+  return &outbox.replies[(outbox.head + i) % REPLY_MAX];
+}
+
+static bool
+copy_tuple(DictionaryIterator *output, const Tuple *tuple)
+{
+  switch (tuple->type) {
+  case TUPLE_BYTE_ARRAY:
+    return dict_write_data(output, tuple->key, tuple->value->data,
+                           tuple->length) == DICT_OK;
+  case TUPLE_CSTRING:
+    return dict_write_cstring(output, tuple->key,
+                              tuple->value->cstring) == DICT_OK;
+  default:
+    return dict_write_int(output, tuple->key, tuple->value, tuple->length,
+                          tuple->type == TUPLE_INT) == DICT_OK;
+  }
+}
+
+static void resend(void *data);
+
+// The head reply failed; resend it shortly, unless it has failed too often.
+static void
+retry(void)
+{
+  if (++reply_at(0)->tries >= REPLY_TRIES) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Dropping reply after %u tries!",
+            (unsigned) REPLY_TRIES);
+    outbox.head = (outbox.head + 1) % REPLY_MAX;
+    outbox.count--;
+    stats.dropped++;
+  } else {
+    stats.retries++;
+  }
+
+  if (!outbox.timer && outbox.count > 0)
+    outbox.timer = app_timer_register(REPLY_RETRY, resend, NULL);
+}
+
 static void
-respond(const char *hash, const char *msg, bool success)
+pump(void)
 {
+  DictionaryIterator stored;
   DictionaryIterator *output;
+  struct reply *reply;
+  Tuple *tuple;
 
-   // Create the response message.
+  if (outbox.sending || outbox.count == 0)
+    return;
+
+  reply = reply_at(0);
   if (app_message_outbox_begin(&output) != APP_MSG_OK) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Failure starting reply!");
+    retry();
     return;
   }
 
+  tuple = dict_read_begin_from_buffer(&stored, reply->buf, reply->size);
+  for (; tuple; tuple = dict_read_next(&stored)) {
+    if (!copy_tuple(output, tuple))
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Failure copying reply!");
+  }
+
+  if (app_message_outbox_send() != APP_MSG_OK) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Error sending response!");
+    retry();
+    return;
+  }
+
+  outbox.sending = true;
+}
+
+static void
+resend(void *data)
+{
+  outbox.timer = NULL;
+  pump();
+}
+
+static bool
+reply_is_ack(const struct reply *reply, DictionaryIterator *iter)
+{
+  return dict_read_begin_from_buffer(iter, reply->buf, reply->size) &&
+         dict_find(iter, KEY_ACK);
+}
+
+/*
+ * A newer acknowledgement supersedes one for the same transfer that has not
+ * been sent yet; overwrite it rather than queueing another.
+ */
+static bool
+coalesce(const struct reply *reply)
+{
+  DictionaryIterator iter;
+  Tuple *hash;
+
+  if (!reply_is_ack(reply, &iter))
+    return false;
+
+  hash = dict_find(&iter, KEY_HASH);
+  for (uint8_t i = outbox.sending ? 1 : 0; hash && i < outbox.count; i++) {
+    struct reply *queued = reply_at(i);
+    DictionaryIterator other;
+    Tuple *tuple;
+
+    if (!reply_is_ack(queued, &other))
+      continue;
+
+    tuple = dict_find(&other, KEY_HASH);
+    if (!tuple || strcmp(tuple->value->cstring, hash->value->cstring) != 0)
+      continue;
+
+    // Keep the older timestamp; latency counts from the first request.
+    memcpy(queued->buf, reply->buf, reply->size);
+    queued->size = reply->size;
+    stats.coalesced++;
+    return true;
+  }
+
+  return false;
+}
+
+static DictionaryIterator *
+reply_begin(const char *hash)
+{
+  struct reply *reply;
+
+  if (outbox.count == REPLY_MAX) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Reply queue full!");
+    stats.dropped++;
+    return NULL;
+  }
+
+   // Create the response message.
+  reply = reply_at(outbox.count);
+  if (dict_write_begin(&outbox.iter, reply->buf, sizeof(reply->buf))
+      != DICT_OK) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Failure starting reply!");
+    return NULL;
+  }
+
   // Save the hash in the response.
-  if (dict_write_cstring(output, KEY_HASH, hash) != DICT_OK) {
+  if (dict_write_cstring(&outbox.iter, KEY_HASH, hash) != DICT_OK) {
     APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting hash!");
-    return;
+    return NULL;
   }
-  
+
+  return &outbox.iter;
+}
+
+static void
+reply_send(DictionaryIterator *output)
+{
+  struct reply *reply = reply_at(outbox.count);
+
+  reply->size = dict_write_end(output);
+  reply->tries = 0;
+  reply->queued = now_ms();
+
+  // Queue it, and send it if the outbox is free.
+  if (!coalesce(reply))
+    outbox.count++;
+  pump();
+}
+
+void
+on_sent(DictionaryIterator *iterator)
+{
+  uint32_t latency;
+
+  if (!outbox.sending || outbox.count == 0)
+    return;
+
+  latency = now_ms() - reply_at(0)->queued;
+  stats.latency += latency;
+  stats.worst = MAX(stats.worst, latency);
+  stats.sent++;
+
+  outbox.sending = false;
+  outbox.head = (outbox.head + 1) % REPLY_MAX;
+  outbox.count--;
+  pump();
+}
+
+void
+on_failed(DictionaryIterator *iterator, AppMessageResult reason)
+{
+  if (!outbox.sending || outbox.count == 0)
+    return;
+
+  APP_LOG(APP_LOG_LEVEL_WARNING, "Reply failed: %d!", reason);
+  outbox.sending = false;
+  retry();
+}
+
+void
+msg_get_stats(msg_stats *out)
+{
+  *out = stats;
+}
+
+void
+msg_set_changed_handler(msg_changed handler, void *context)
+{
+  notify.handler = handler;
+  notify.context = context;
+}
+
+static void
+respond(const char *hash, const char *msg, bool success)
+{
+  DictionaryIterator *output;
+
+  output = reply_begin(hash);
+  if (!output)
+    return;
+
   // Save the message.
   if (msg && dict_write_cstring(output, KEY_MESSAGE, msg) != DICT_OK)
     APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting message!");  
@@ -71,20 +366,184 @@ respond(const char *hash, const char *msg, bool success)
   if (dict_write_uint8(output, KEY_SUCCESS, success) != DICT_OK)
     APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting success!");
 
-  // Send it.
-  if (app_message_outbox_send() != APP_MSG_OK)
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Error sending response!");
+  reply_send(output);
+}
+
+// Asks the sender to retransmit the fragment at offset.
+static void
+respond_nack(const char *hash, uint32_t offset)
+{
+  DictionaryIterator *output;
+
+  output = reply_begin(hash);
+  if (!output)
+    return;
+
+  if (dict_write_uint32(output, KEY_NACK, offset) != DICT_OK)
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting nack!");
+
+  reply_send(output);
+}
+
+static size_t
+put_range(uint8_t *buf, size_t len, uint16_t offset, uint16_t size)
+{
+  buf[len++] = offset;
+  buf[len++] = offset >> 8;
+  buf[len++] = size;
+  buf[len++] = size >> 8;
+  return len;
+}
+
+/*
+ * Tells the sender which byte ranges it still has to send, as little endian
+ * (offset, length) uint16 pairs. A length of zero means "to the end".
+ */
+static void
+respond_missing(const char *hash, const struct message *msg)
+{
+  uint8_t buf[(RANGE_MAX + 1) * 4];
+  DictionaryIterator *output;
+  uint16_t prev = 0;
+  size_t len = 0;
+
+  for (size_t i = 0; msg && i < msg->nranges; i++) {
+    if (msg->ranges[i].start > prev)
+      len = put_range(buf, len, prev, msg->ranges[i].start - prev);
+    prev = msg->ranges[i].end;
+  }
+
+  if (!msg || !msg->declared || msg->key == KEY_PACKED)
+    len = put_range(buf, len, prev, 0);
+  else if (prev < msg->size)
+    len = put_range(buf, len, prev, msg->size - prev);
+
+  output = reply_begin(hash);
+  if (!output)
+    return;
+
+  if (dict_write_data(output, KEY_MISSING, buf, len) != DICT_OK)
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting missing ranges!");
+
+  reply_send(output);
+}
+
+// Asks the sender to retry the whole transfer later; nothing was kept.
+static void
+respond_busy(const char *hash)
+{
+  DictionaryIterator *output;
+
+  stats.busy++;
+  output = reply_begin(hash);
+  if (!output)
+    return;
+
+  if (dict_write_cstring(output, KEY_MESSAGE,
+                         "The Pebble is busy; try again.") != DICT_OK ||
+      dict_write_uint8(output, KEY_SUCCESS, false) != DICT_OK ||
+      dict_write_uint32(output, KEY_RETRY, MSG_RETRY) != DICT_OK)
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting retry!");
+
+  reply_send(output);
+}
+
+// Counts n more bytes against the budget shared by all transfers.
+static bool
+charge(struct message *msg, size_t n)
+{
+  if (reserved + n > MSG_BUDGET)
+    return false;
+
+  reserved += n;
+  msg->charged += n;
+  stats.peak = MAX(stats.peak, reserved);
+  return true;
+}
+
+// Charges n more bytes for a transfer, answering the sender on failure.
+// What can never fit is final; what only lacks room now is worth a retry.
+static bool
+reserve(struct message *msg, size_t n)
+{
+  if (msg->charged + n > MSG_BUDGET) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (length)!");
+    respond(msg->hash, "The message is too large.", false);
+    return false;
+  }
+
+  if (!charge(msg, n)) {
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Transfer budget exhausted!");
+    respond_busy(msg->hash);
+    return false;
+  }
+
+  return true;
 }
 
+// One timer sweeps all slots, and only while any transfer is open.
 static void
-tick(void *data)
+sweep(void *data)
 {
-  time_t expire = time(NULL) - MSG_TIMEOUT;
+  time_t now = time(NULL);
+  bool open = false;
 
+  sweeper = NULL;
   for (size_t i = 0; i < MSG_MAX; i++) {
-    if (messages[i].start < expire)
+    if (!messages[i].hash)
+      continue;
+
+    // Only idle transfers expire; slow but progressing ones may resume.
+    if (messages[i].touched + MSG_TIMEOUT <= now && !messages[i].batch)
       message_free(&messages[i]);
+    else
+      open = true;
   }
+
+  if (open)
+    sweeper = app_timer_register(MSG_SWEEP * 1000, sweep, NULL);
+}
+
+// Records [start, end) as received. Fails if the slot is too fragmented.
+static bool
+range_add(struct message *msg, uint16_t start, uint16_t end)
+{
+  size_t i = 0;
+  size_t j;
+
+  while (i < msg->nranges && msg->ranges[i].end < start)
+    i++;
+
+  // Merge every range that overlaps or touches the new one.
+  for (j = i; j < msg->nranges && msg->ranges[j].start <= end; j++) {
+    start = MIN(start, msg->ranges[j].start);
+    end = MAX(end, msg->ranges[j].end);
+  }
+
+  if (j == i) {
+    if (msg->nranges >= RANGE_MAX)
+      return false;
+
+    memmove(&msg->ranges[i + 1], &msg->ranges[i],
+            (msg->nranges - i) * sizeof(*msg->ranges));
+    msg->nranges++;
+  } else {
+    memmove(&msg->ranges[i + 1], &msg->ranges[j],
+            (msg->nranges - j) * sizeof(*msg->ranges));
+    msg->nranges -= j - i - 1;
+  }
+
+  msg->ranges[i] = (struct range) { start, end };
+  return true;
+}
+
+static inline size_t
+contiguous(const struct message *msg)
+{
+  if (msg->nranges == 0 || msg->ranges[0].start != 0)
+    return 0;
+
+  return msg->ranges[0].end;
 }
 
 static Tuple *
@@ -129,11 +588,105 @@ get_uint(DictionaryIterator *iterator, uint32_t key)
   return 0;
 }
 
+static inline hash_ctx *
+scratch(const struct message *msg)
+{
+  return (hash_ctx *) ((uint8_t *) msg->ctx + msg->spec->ctx);
+}
+
+static inline uint8_t *
+digest(const struct message *msg)
+{
+  return (uint8_t *) msg->ctx + msg->spec->ctx * 2;
+}
+
+// Finds the hash of a "type:hex" expected digest.
+static const hash_spec *
+hash_spec_of(const char *hash)
+{
+  const char *sep;
+  hash_type type;
+
+  sep = strchr(hash, ':');
+  if (!sep)
+    return NULL;
+
+  type = hash_type_findn(hash, sep - hash);
+  if (type == HASH_TYPE_UNKNOWN)
+    return NULL;
+
+  return hash_spec_get(type);
+}
+
+// Prepares the running hash from the "type:hex" expected digest.
+static bool
+hash_setup(struct message *msg)
+{
+  msg->ctx = malloc(msg->spec->ctx * 2 + msg->spec->hash);
+  if (!msg->ctx)
+    return false;
+
+  if (!hash_from_hex(strchr(msg->hash, ':') + 1, digest(msg),
+                     msg->spec->hash))
+    return false;
+
+  msg->spec->init(msg->ctx);
+  return true;
+}
+
+// Senders may name a transfer with KEY_ID; otherwise its hash names it.
+static uint32_t
+transfer_id(DictionaryIterator *iterator, const char *hash)
+{
+  if (dict_find(iterator, KEY_ID))
+    return get_uint(iterator, KEY_ID);
+
+  return murmur3_32(hash, strlen(hash));
+}
+
+static struct message *
+find(uint32_t id)
+{
+  for (size_t i = 0; i < MSG_MAX; i++) {
+    if (messages[i].hash && messages[i].id == id)
+      return &messages[i];
+  }
+
+  return NULL;
+}
+
+/*
+ * Windowed acknowledgement: every byte below KEY_ACK has arrived, and the
+ * sender may have up to KEY_CREDIT more bytes in flight beyond it.
+ */
+static void
+respond_ack(const struct message *msg)
+{
+  DictionaryIterator *output;
+  size_t ack = contiguous(msg);
+  size_t credit = MSG_WINDOW;
+
+  if (msg->declared && msg->key != KEY_PACKED)
+    credit = MIN(credit, msg->size - ack);
+
+  output = reply_begin(msg->hash);
+  if (!output)
+    return;
+
+  if (dict_write_uint32(output, KEY_ACK, ack) != DICT_OK ||
+      dict_write_uint32(output, KEY_CREDIT, credit) != DICT_OK)
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting acknowledgement!");
+
+  reply_send(output);
+}
+
 static bool
 get_slot(DictionaryIterator *iterator, struct message **out)
 {
   struct message *msg = NULL;
   Tuple *tuple = NULL;
+  const char *hash;
+  uint32_t id;
   
   // Get the hash.
   tuple = get(iterator, KEY_HASH, TUPLE_CSTRING);
@@ -142,157 +695,599 @@ get_slot(DictionaryIterator *iterator, struct message **out)
     return false;
   }
 
-  // Get a message slot.
-  for (size_t i = 0; i < MSG_MAX; i++) {
-    // Get an empty message slot.
-    if (messages[i].hash == NULL)
-      msg = &messages[i];
+  hash = tuple->value->cstring;
+  id = transfer_id(iterator, hash);
 
-    // Get the existing message slot.
-    else if (strcmp(messages[i].hash, tuple->value->cstring) == 0) {
+  // Get the existing message slot, or else an empty one.
+  msg = find(id);
+  for (size_t i = 0; !msg && i < MSG_MAX; i++) {
+    if (messages[i].hash == NULL)
       msg = &messages[i];
-      break;
-    }
   }
   
   // No existing message found and no empty slots.
   if (!msg) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Too many outstanding messages!");
-    respond(tuple->value->cstring, "The Pebble is busy; try again.", false);
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Too many outstanding messages!");
+    respond_busy(hash);
     return false;
   }
 
-  // If we got an empty slot, fill in the hash and start time.
+  // If we got an empty slot, fill in the hash.
   if (!msg->hash) {
-    app_timer_register(MSG_TIMEOUT * 1000, tick, NULL);
-    msg->start = time(NULL);
-    msg->hash = __strdup(tuple->value->cstring);
+    msg->spec = hash_spec_of(hash);
+    if (!msg->spec) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (hash)!");
+      respond(hash, "Invalid message hash!", false);
+      message_free(msg);
+      return false;
+    }
+
+    // The slot's own state counts against the budget, like its data.
+    if (!charge(msg, strlen(hash) + 1 +
+                msg->spec->ctx * 2 + msg->spec->hash)) {
+      APP_LOG(APP_LOG_LEVEL_WARNING, "Transfer budget exhausted!");
+      respond_busy(hash);
+      message_free(msg);
+      return false;
+    }
+
+    if (!sweeper)
+      sweeper = app_timer_register(MSG_SWEEP * 1000, sweep, NULL);
+    msg->id = id;
+    msg->started = now_ms();
+    msg->hash = __strdup(hash);
     if (!msg->hash) {
       APP_LOG(APP_LOG_LEVEL_ERROR, "Out of memory!");
-      respond(tuple->value->cstring, "The Pebble is out of memory.", false);
+      respond(hash, "The Pebble is out of memory.", false);
+      message_free(msg);
+      return false;
+    }
+
+    if (!hash_setup(msg)) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (hash)!");
+      respond(msg->hash, "Invalid message hash!", false);
+      message_free(msg);
       return false;
     }
   }
   
+  msg->touched = time(NULL);
   *out = msg;
   return true;
 }
 
+/*
+ * Packed data is unpacked straight into the buffer and hashed as it goes,
+ * so it is taken strictly in order; the windowed ack reports any hole.
+ */
+static bool
+unpack_fragment(struct message *msg, size_t offset, const uint8_t *data,
+                size_t size, uint8_t **out)
+{
+  size_t received = contiguous(msg);
+  size_t pos = msg->hashed;
+
+  if (offset != received) {
+    if (offset > received)
+      respond_ack(msg);
+    return true;
+  }
+
+  if (!range_add(msg, offset, offset + size))
+    return true;
+
+  if (!unpack(&msg->unpack, data, size, msg->buffer, &pos, msg->size)) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (packed)!");
+    respond(msg->hash, "Invalid packed message!", false);
+    return false;
+  }
+
+  msg->spec->update(msg->ctx, msg->buffer + msg->hashed, pos - msg->hashed);
+  msg->hashed = pos;
+  if (msg->hashed == msg->size) {
+    *out = (uint8_t *) msg->buffer;
+    return true;
+  }
+
+  if (++msg->fragments % MSG_ACK_EVERY == 0)
+    respond_ack(msg);
+
+  return true;
+}
+
+// Moves the buffer to one of size bytes plus a NUL, keeping what it held.
+static bool
+resize(struct message *msg, size_t size)
+{
+  char *tmp;
+
+  tmp = malloc(size + 1);
+  if (!tmp) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Out of memory!");
+    respond(msg->hash, "The Pebble is out of memory.", false);
+    return false;
+  }
+
+  if (msg->size > 0)
+    memmove(tmp, msg->buffer, msg->size);
+
+  free(msg->buffer);
+  msg->buffer = tmp;
+  msg->buffer[size] = '\0';
+  msg->size = size;
+  return true;
+}
+
 static bool
-copy_fragment(DictionaryIterator *iterator, struct message *msg)
+copy_fragment(DictionaryIterator *iterator, struct message *msg,
+              uint8_t **out)
 {
   size_t offset = 0;
-  size_t newsize;
+  size_t length;
+  size_t size;
+  size_t grow;
+  size_t end;
+  uint8_t *data;
   Tuple *tuple;
-  
-  // Get offset and data.
+
+  *out = NULL;
+
+  // Get offset and data; a URI is a string, others are raw bytes.
   offset = get_uint(iterator, KEY_OFFSET);
-  tuple = get(iterator, KEY_MESSAGE, TUPLE_CSTRING);
-  if (!tuple) {
+  if (dict_find(iterator, KEY_TOKEN) || dict_find(iterator, KEY_PACKED)) {
+    tuple = get(iterator, dict_find(iterator, KEY_TOKEN) ? KEY_TOKEN
+                                                         : KEY_PACKED,
+                TUPLE_BYTE_ARRAY);
+    if (tuple) {
+      data = tuple->value->data;
+      size = tuple->length;
+    }
+  } else {
+    tuple = get(iterator, KEY_MESSAGE, TUPLE_CSTRING);
+    if (tuple) {
+      data = (uint8_t *) tuple->value->cstring;
+      size = tuple->length - 1;
+    }
+  }
+  if (!tuple || (msg->key != 0 && msg->key != tuple->key)) {
     APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (msg)!");
     respond(msg->hash, "Invalid message value!", false);
     return false;
   }
+  msg->key = tuple->key;
+  end = offset + size;
+  if (end > UINT16_MAX) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (offset)!");
+    respond(msg->hash, "Invalid message offset!", false);
+    return false;
+  }
 
-  // Allocate buffer if needed.
-  newsize = offset + tuple->length - 1;
-  if (msg->size < newsize) {
-    char *tmp = malloc(newsize);
-    if (!tmp) {
-      APP_LOG(APP_LOG_LEVEL_ERROR, "Out of memory!");
-      respond(msg->hash, "The Pebble is out of memory.", false);
+  // A damaged fragment is not fatal; only it needs to be sent again.
+  if (dict_find(iterator, KEY_CHECKSUM) &&
+      get_uint(iterator, KEY_CHECKSUM) !=
+      murmur3_32(data, size)) {
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Bad checksum at offset %u!",
+            (unsigned) offset);
+    respond_nack(msg->hash, offset);
+    return true;
+  }
+
+  // Any fragment may declare the total length; it is applied only once.
+  if (!msg->declared && dict_find(iterator, KEY_LENGTH)) {
+    length = get_uint(iterator, KEY_LENGTH);
+
+    // Fragments taken before the declaration must fit within it.
+    if (length < msg->size) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (length)!");
+      respond(msg->hash, "Invalid message length!", false);
+      return false;
+    }
+
+    // The slot's own state is already charged; count it too.
+    grow = length - msg->size + (msg->buffer ? 0 : 1);
+    if (length >= MSG_BUDGET || msg->charged + grow > MSG_BUDGET) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (length)!");
+      respond(msg->hash, "The message is too large.", false);
       return false;
     }
 
-    if (msg->size > 0)
-      memmove(tmp, msg->buffer, msg->size);
-   
-    free(msg->buffer); 
-    msg->buffer = tmp;
-    msg->size = newsize;
+    // The whole message is in this fragment; use it where it lies.
+    if (!msg->buffer && offset == 0 && end == length &&
+        msg->key != KEY_PACKED) {
+      msg->declared = true;
+      msg->size = length;
+      msg->spec->update(msg->ctx, data, length);
+      msg->hashed = length;
+      range_add(msg, 0, length);
+      *out = data;
+      return true;
+    }
+
+    if (!reserve(msg, grow))
+      return false;
+
+    if (!resize(msg, length))
+      return false;
+    msg->declared = true;
+  }
+
+  if (msg->key == KEY_PACKED) {
+    if (!msg->buffer) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (length)!");
+      respond(msg->hash, "Invalid message length!", false);
+      return false;
+    }
+
+    return unpack_fragment(msg, offset, data, size, out);
+  } else if (msg->declared) {
+    if (!msg->buffer || end > msg->size) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (offset)!");
+      respond(msg->hash, "Invalid message offset!", false);
+      return false;
+    }
+  } else if (msg->size < end) {
+    // Legacy senders don't declare a length; grow the buffer.
+    if (!reserve(msg, end - msg->size + (msg->buffer ? 0 : 1)))
+      return false;
+
+    if (!resize(msg, end))
+      return false;
+  }
+
+  // Too many holes; drop it. The sender will see it as missing.
+  if (!range_add(msg, offset, end)) {
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Message too fragmented; dropped.");
+    return true;
   }
 
   // Copy in this block of data.
-  memmove(msg->buffer + offset, tuple->value->cstring, tuple->length - 1);
+  memmove(msg->buffer + offset, data, size);
+
+  // Absorb any newly contiguous data into the running hash.
+  end = contiguous(msg);
+  if (end > msg->hashed) {
+    msg->spec->update(msg->ctx, msg->buffer + msg->hashed,
+                      end - msg->hashed);
+    msg->hashed = end;
+  }
+
+  if (msg->hashed == msg->size) {
+    *out = (uint8_t *) msg->buffer;
+    return true;
+  }
+
+  // Acknowledge periodically, and at once when a hole shows up.
+  if (++msg->fragments % MSG_ACK_EVERY == 0 || offset > msg->hashed)
+    respond_ack(msg);
+
   return true;
 }
 
 static bool
 validate(struct message *msg)
 {
-  const hash_spec *spec;
-  hash_type type;
-  hash_ctx *ctx;
-  uint8_t *hsh;
-  char *hex;
-  char *sep;
-  bool ret;
- 
-  sep = strchr(msg->hash, ':');
-  if (!sep)
+  uint8_t hsh[HASH_SIZE_MAX];
+
+  // Finish a copy, so later fragments can still be absorbed.
+  memcpy(scratch(msg), msg->ctx, msg->spec->ctx);
+  msg->spec->finish(scratch(msg), hsh);
+  return memcmp(hsh, digest(msg), msg->spec->hash) == 0;
+}
+
+/*
+ * A transfer may carry several tokens: URIs separated by newlines, or TLV
+ * tokens separated by TOKEN_TLV_END records. Returns the length of the
+ * token at data + pos and sets *next past its separator.
+ */
+static size_t
+split(const struct message *msg, const uint8_t *data, size_t pos,
+      size_t *next)
+{
+  size_t i = pos;
+
+  if (msg->key == KEY_TOKEN) {
+    while (i + 2 <= msg->size && data[i] != TOKEN_TLV_END)
+      i += 2 + data[i + 1];
+    i = MIN(i, msg->size);
+    *next = MIN(i + 2, msg->size);
+  } else {
+    while (i < msg->size && data[i] != '\n')
+      i++;
+    *next = MIN(i + 1, msg->size);
+  }
+
+  return i - pos;
+}
+
+static size_t
+count(const struct message *msg, const uint8_t *data)
+{
+  size_t n = 0;
+
+  for (size_t pos = 0, next; pos < msg->size; pos = next) {
+    if (split(msg, data, pos, &next) > 0)
+      n++;
+  }
+
+  return n;
+}
+
+/*
+ * Parses every token of a batch, stores them all with one update of the
+ * token order and replies with one TOKEN_ADD_* byte per token. This runs
+ * as a scheduler task, one token per step, so that a large batch doesn't
+ * hold up clicks and redraws; the transfer stays in its slot until then.
+ */
+static bool
+provision(void *data)
+{
+  struct message *msg = data;
+  struct batch *b = msg->batch;
+  uint8_t stored[MSG_BATCH];
+  DictionaryIterator *output;
+  uint8_t added;
+
+  while (b->pos < msg->size) {
+    uint8_t *tok = (uint8_t *) msg->buffer + b->pos;
+    size_t len = split(msg, (uint8_t *) msg->buffer, b->pos, &b->pos);
+    bool parsed;
+
+    if (len == 0)
+      continue;
+
+    // The store can't hold more than a batch; don't bother parsing the rest.
+    if (b->m == MSG_BATCH) {
+      b->i++;
+      continue;
+    }
+
+    if (msg->key == KEY_TOKEN)
+      parsed = token_decode(tok, len, &b->tokens[b->m]);
+    else
+      parsed = token_parsen((char *) tok, len, &b->tokens[b->m]);
+
+    b->results[b->i] = TOKEN_ADD_INVALID;
+    if (parsed)
+      b->index[b->m++] = b->i;
+    b->i++;
     return false;
-  
-  type = hash_type_findn(msg->hash, sep - msg->hash);
-  if (type == HASH_TYPE_UNKNOWN)
+  }
+
+  added = token_add_batch(b->tokens, b->m, stored);
+  for (uint8_t i = 0; i < b->m; i++)
+    b->results[b->index[i]] = stored[i];
+
+  output = reply_begin(msg->hash);
+  if (output) {
+    if (dict_write_data(output, KEY_RESULTS, b->results, b->n) != DICT_OK ||
+        dict_write_uint8(output, KEY_SUCCESS, true) != DICT_OK)
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting results!");
+    reply_send(output);
+  }
+
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Added %u of %u tokens.",
+          (unsigned) added, (unsigned) b->n);
+
+  message_free(msg);
+  if (added > 0 && notify.handler)
+    notify.handler(notify.context);
+  return true;
+}
+
+// Queues the batch for provision(). On failure, the caller frees msg.
+static bool
+add_batch(struct message *msg, size_t n)
+{
+  struct batch *b;
+
+  // One reply carries every result; refuse what it can't hold up front.
+  if (dict_calc_buffer_size(3, strlen(msg->hash) + 1, n, 1) > REPLY_SIZE) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message (batch)!");
+    respond(msg->hash, "Too many tokens in one message.", false);
+    return false;
+  }
+
+  // Parsed tokens sit on top of the buffer; they count against the budget.
+  if (!reserve(msg, sizeof(*b) + n + MIN(n, MSG_BATCH) * sizeof(token)))
     return false;
 
-  spec = hash_spec_get(type);
-  if (!spec)
+  b = msg->batch = malloc(sizeof(*b));
+  if (b) {
+    *b = (struct batch) { .n = n };
+    b->results = malloc(n);
+    b->tokens = malloc(MIN(n, MSG_BATCH) * sizeof(token));
+  }
+
+  if (!b || !b->results || !b->tokens) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Out of memory!");
+    respond(msg->hash, "The Pebble is out of memory.", false);
     return false;
+  }
 
-  ctx = malloc(spec->ctx);
-  hsh = malloc(spec->hash);
-  hex = malloc(spec->hash * 2);
-  if (!ctx || !hsh || !hex) {
-    free(ctx);
-    free(hsh);
-    free(hex);
+  if (!sched_add(SCHED_PRIO_NORMAL, provision, msg)) {
+    respond_busy(msg->hash);
     return false;
   }
 
-  spec->init(ctx);
-  spec->update(ctx, msg->buffer, msg->size);
-  spec->finish(ctx, hsh);
-  hash_to_hex(hsh, spec->hash, hex);
+  memset(b->results, TOKEN_ADD_FULL, n);
+  return true;
+}
+
+static void
+put_id(uint8_t *buf, uint32_t id)
+{
+  buf[0] = id;
+  buf[1] = id >> 8;
+  buf[2] = id >> 16;
+  buf[3] = id >> 24;
+}
+
+static uint32_t
+get_id(const uint8_t *buf)
+{
+  return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+/*
+ * The digest of the token set: murmur3 over the ids, sorted ascending and
+ * packed as little endian uint32s. It doesn't depend on display order.
+ */
+static uint32_t
+ids_digest(uint8_t *buf, const uint32_t *ids, uint8_t n)
+{
+  uint32_t sorted[TOKEN_MAX];
+
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t j;
+
+    for (j = i; j > 0 && sorted[j - 1] > ids[i]; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = ids[i];
+  }
+
+  for (uint8_t i = 0; i < n; i++)
+    put_id(&buf[i * 4], sorted[i]);
+
+  return murmur3_32(buf, n * 4);
+}
+
+/*
+ * Delta sync: the sender passes the digest of the set it believes the watch
+ * holds. The watch always replies with its own digest, and with its ids
+ * (display order, little endian uint32s) only when the two differ.
+ */
+static void
+respond_sync(const char *hash, uint32_t expected)
+{
+  uint8_t buf[TOKEN_MAX * 4];
+  uint32_t ids[TOKEN_MAX];
+  DictionaryIterator *output;
+  uint32_t actual;
+  uint8_t n;
+
+  n = token_ids(ids);
+  actual = ids_digest(buf, ids, n);
+  for (uint8_t i = 0; i < n; i++)
+    put_id(&buf[i * 4], ids[i]);
 
-  ret = __strncasecmp(++sep, hex, spec->hash * 2) == 0;
-  free(ctx);
-  free(hsh);
-  free(hex);
-  return ret;
+  output = reply_begin(hash);
+  if (!output)
+    return;
+
+  if (dict_write_uint32(output, KEY_SYNC, actual) != DICT_OK ||
+      (actual != expected &&
+       dict_write_data(output, KEY_IDS, buf, n * 4) != DICT_OK))
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Failure setting ids!");
+
+  reply_send(output);
+}
+
+// Deletes the little endian uint32 ids in KEY_DELETE; replies like a sync.
+static bool
+delete_ids(const char *hash, const Tuple *tuple)
+{
+  const uint8_t *data = tuple->value->data;
+  uint32_t ids[TOKEN_MAX];
+  uint8_t n = 0;
+  uint8_t deleted;
+
+  for (size_t i = 0; i + 4 <= tuple->length && n < TOKEN_MAX; i += 4)
+    ids[n++] = get_id(&data[i]);
+
+  deleted = token_del_ids(ids, n);
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Deleted %u of %u tokens.",
+          (unsigned) deleted, (unsigned) n);
+
+  respond_sync(hash, 0);
+  return deleted > 0;
 }
 
 void
-on_message(DictionaryIterator *iterator, bool *added)
+on_message(DictionaryIterator *iterator, bool *changed)
 {
   struct message *msg = NULL;
   token token;
+  uint8_t *data;
+  bool parsed;
+  size_t n;
   
-  *added = false;
+  *changed = false;
+
+  // Sync and delete requests carry no token data.
+  if (dict_find(iterator, KEY_SYNC) || dict_find(iterator, KEY_DELETE)) {
+    Tuple *hash = get(iterator, KEY_HASH, TUPLE_CSTRING);
+    Tuple *ids = dict_find(iterator, KEY_DELETE);
+
+    if (!hash)
+      return;
+
+    if (!ids)
+      respond_sync(hash->value->cstring, get_uint(iterator, KEY_SYNC));
+    else if (get(iterator, KEY_DELETE, TUPLE_BYTE_ARRAY))
+      *changed = delete_ids(hash->value->cstring, ids);
+    return;
+  }
+
+  // A message without data is a status query from a resuming sender.
+  if (!dict_find(iterator, KEY_MESSAGE) && !dict_find(iterator, KEY_TOKEN) &&
+      !dict_find(iterator, KEY_PACKED)) {
+    Tuple *hash = get(iterator, KEY_HASH, TUPLE_CSTRING);
+    if (hash)
+      respond_missing(hash->value->cstring,
+                      find(transfer_id(iterator, hash->value->cstring)));
+    return;
+  }
  
   if (!get_slot(iterator, &msg))
     return;
 
-  if (!copy_fragment(iterator, msg))
+  // Its tokens are being stored; the results follow when they are.
+  if (msg->batch)
+    return;
+
+  if (!copy_fragment(iterator, msg, &data))
     goto egress;
 
-  if (!validate(msg))
+  if (!data)
     return;
 
-  if (!token_parse(msg->buffer, &token)) {
-    respond(msg->hash, "Error parsing URI!", false);
+  if (!validate(msg)) {
+    // Without a declared length, more data may yet arrive.
+    if (!msg->declared)
+      return;
+
+    respond(msg->hash, "Message failed validation!", false);
+    goto egress;
+  }
+
+  n = count(msg, data);
+  if (n > 1) {
+    if (add_batch(msg, n))
+      return;
+    goto egress;
+  }
+
+  if (msg->key == KEY_TOKEN)
+    parsed = token_decode(data, msg->size, &token);
+  else
+    parsed = token_parsen((char *) data, msg->size, &token);
+  if (!parsed) {
+    respond(msg->hash, "Error parsing token!", false);
     goto egress;
   }
   
   if (!token_exists(&token)) {
-    *added = token_add(&token);
-    if (!*added) {
+    *changed = token_add(&token);
+    if (!*changed) {
       respond(msg->hash, "Error adding token!", false);
       goto egress;
     }
   }
 
   respond(msg->hash, NULL, true);
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Received %u bytes at %u B/s.",
+          (unsigned) msg->size,
+          (unsigned) (msg->size * 1000 / MAX(now_ms() - msg->started, 1)));
 
 egress:
   message_free(msg);
@@ -21,10 +21,59 @@
 #pragma once
 #include <pebble.h>
 
-#define KEY_HASH    0
-#define KEY_OFFSET  1
-#define KEY_MESSAGE 2
-#define KEY_SUCCESS 3
+#define KEY_HASH     0
+#define KEY_OFFSET   1
+#define KEY_MESSAGE  2
+#define KEY_SUCCESS  3
+#define KEY_LENGTH   4
+#define KEY_MISSING  5
+#define KEY_CHECKSUM 6
+#define KEY_NACK     7
+#define KEY_ACK      8
+#define KEY_CREDIT   9
+#define KEY_TOKEN    10
+#define KEY_RESULTS  11
+#define KEY_SYNC     12
+#define KEY_DELETE   13
+#define KEY_IDS      14
+#define KEY_RETRY    15
+#define KEY_ID       16
+#define KEY_PACKED   18 /* otpauth URIs, packed as in pack.h */
+
+/*
+ * The outbox only ever holds one queued reply, so it is sized for that.
+ * The inbox stays at the SDK maximum, which senders size their fragments
+ * for; AppMessage can't be reopened at another size once it is open.
+ */
+#define MSG_OUTBOX_SIZE 256
+
+typedef struct {
+  uint32_t sent;
+  uint32_t retries;
+  uint32_t dropped;   /* Replies lost to a full queue or too many retries. */
+  uint32_t coalesced; /* Acknowledgements superseded while queued. */
+  uint32_t latency;   /* Total milliseconds from queueing to delivery. */
+  uint32_t worst;     /* Longest of those, in milliseconds. */
+  uint32_t busy;      /* Transfers turned away with KEY_RETRY. */
+  uint16_t peak;      /* Most bytes held by transfers at once. */
+} msg_stats;
+
+/* A batch of tokens is stored later, by the scheduler. */
+void
+on_message(DictionaryIterator *iterator, bool *changed);
+
+/* Replies are queued; these drain the queue as the outbox frees up. */
+void
+on_sent(DictionaryIterator *iterator);
+
+void
+on_failed(DictionaryIterator *iterator, AppMessageResult reason);
+
+void
+msg_get_stats(msg_stats *stats);
+
+/* Called whenever tokens are stored outside of on_message(). */
+typedef void (*msg_changed)(void *context);
 
 void
-on_message(DictionaryIterator *iterator, bool *added);
+msg_set_changed_handler(msg_changed handler, void *context);
@@ -0,0 +1,234 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pack.h"
+
+#include <string.h>
+
+#define PHRASE  0x80
+#define ESCAPE  0xbd
+#define COPY    0xbe
+#define BASE32  0xc0
+#define RUN_MAX 64
+
+static const char *phrases[] = {
+  "otpauth://totp/", "otpauth://hotp/", "?secret=", "&secret=",
+  "?issuer=", "&issuer=", "?algorithm=", "&algorithm=",
+  "?digits=", "&digits=", "?period=", "&period=", "?counter=", "&counter=",
+  "&image=", "SHA1", "SHA256", "SHA512", "MD5", "%40", "%20", "%3A",
+  "@gmail.com", "@google.com", "@outlook.com", "@hotmail.com",
+  "@yahoo.com", "@example.com", ".com", ".org", ".net", "https%3A%2F%2F",
+  "Google", "GitHub", "GitLab", "Microsoft", "Amazon", "Dropbox",
+  "Facebook", "Twitter", "Slack", "Example", "Discord", "Apple",
+  "account", "admin", "user", "mail", "login",
+};
+
+static inline bool
+is_base32(char c)
+{
+  return (c >= 'A' && c <= 'Z') || (c >= '2' && c <= '7');
+}
+
+static inline uint8_t
+from_base32(char c)
+{
+  return c >= 'A' ? c - 'A' : c - '2' + 26;
+}
+
+static inline char
+to_base32(uint8_t v)
+{
+  return v < 26 ? 'A' + v : '2' + v - 26;
+}
+
+static size_t
+pack_run(const char *in, size_t n, uint8_t *out)
+{
+  uint16_t bits = 0;
+  uint8_t nbits = 0;
+  size_t o = 0;
+
+  out[o++] = BASE32 | (n - 1);
+  for (size_t i = 0; i < n; i++) {
+    bits = bits << 5 | from_base32(in[i]);
+    nbits += 5;
+    if (nbits >= 8) {
+      nbits -= 8;
+      out[o++] = bits >> nbits;
+    }
+  }
+
+  if (nbits > 0)
+    out[o++] = bits << (8 - nbits);
+
+  return o;
+}
+
+size_t
+pack(const char *in, size_t len, uint8_t *out, size_t size)
+{
+  size_t o = 0;
+
+  for (size_t i = 0; i < len; ) {
+    size_t phrase = 0, phrase_len = 0;
+    size_t dist = 0, copy_len = 0;
+    size_t run = 0;
+
+    // Long base32 runs (secrets) pack five bits to the character.
+    while (run < RUN_MAX && i + run < len && is_base32(in[i + run]))
+      run++;
+    if (run >= 8) {
+      if (o + 1 + (run * 5 + 7) / 8 > size)
+        return 0;
+      o += pack_run(&in[i], run, &out[o]);
+      i += run;
+      continue;
+    }
+
+    for (size_t k = 0; k < sizeof(phrases) / sizeof(*phrases); k++) {
+      size_t l = strlen(phrases[k]);
+
+      if (l > phrase_len && l <= len - i && memcmp(&in[i], phrases[k], l) == 0) {
+        phrase = k;
+        phrase_len = l;
+      }
+    }
+
+    // The issuer usually appears twice; copy it from before.
+    for (size_t d = 1; d <= i && d <= UINT8_MAX; d++) {
+      size_t l = 0;
+
+      while (l < UINT8_MAX && i + l < len && in[i + l] == in[i - d + l])
+        l++;
+      if (l > copy_len) {
+        dist = d;
+        copy_len = l;
+      }
+    }
+
+    if (copy_len > 3 && copy_len - 3 > phrase_len - (phrase_len > 0)) {
+      if (o + 3 > size)
+        return 0;
+      out[o++] = COPY;
+      out[o++] = dist;
+      out[o++] = copy_len;
+      i += copy_len;
+    } else if (phrase_len > 1) {
+      if (o + 1 > size)
+        return 0;
+      out[o++] = PHRASE + phrase;
+      i += phrase_len;
+    } else {
+      if (o + 2 > size)
+        return 0;
+      if ((uint8_t) in[i] >= 0x80)
+        out[o++] = ESCAPE;
+      out[o++] = in[i++];
+    }
+  }
+
+  return o;
+}
+
+static bool
+put(char *out, size_t *pos, size_t size, char c)
+{
+  if (*pos >= size)
+    return false;
+
+  out[(*pos)++] = c;
+  return true;
+}
+
+bool
+unpack(pack_state *st, const uint8_t *in, size_t len,
+       char *out, size_t *pos, size_t size)
+{
+  for (size_t i = 0; i < len; i++) {
+    uint8_t b = in[i];
+
+    if (st->need == 0) {
+      if (b < PHRASE) {
+        if (!put(out, pos, size, b))
+          return false;
+      } else if (b < ESCAPE) {
+        size_t phrase = b - PHRASE;
+        const char *p;
+
+        if (phrase >= sizeof(phrases) / sizeof(*phrases))
+          return false;
+        for (p = phrases[phrase]; *p; ) {
+          if (!put(out, pos, size, *p++))
+            return false;
+        }
+      } else if (b == ESCAPE || b == COPY) {
+        st->op = b;
+        st->need = b == ESCAPE ? 1 : 2;
+      } else if (b >= BASE32) {
+        st->op = BASE32;
+        st->arg = (b & ~BASE32) + 1;
+        st->need = (st->arg * 5 + 7) / 8;
+        st->bits = st->nbits = 0;
+      } else {
+        return false;
+      }
+      continue;
+    }
+
+    st->need--;
+    switch (st->op) {
+    case ESCAPE:
+      if (!put(out, pos, size, b))
+        return false;
+      break;
+
+    case COPY:
+      if (st->need == 1) {
+        st->arg = b;
+        break;
+      }
+
+      if (st->arg == 0 || st->arg > *pos)
+        return false;
+      for (uint8_t j = 0; j < b; j++) {
+        if (!put(out, pos, size, out[*pos - st->arg]))
+          return false;
+      }
+      break;
+
+    case BASE32: {
+      uint16_t bits = (uint16_t) st->bits << 8 | b;
+
+      // Emit whole characters; keep the remainder for the next byte.
+      st->nbits += 8;
+      while (st->nbits >= 5 && st->arg > 0) {
+        st->nbits -= 5;
+        st->arg--;
+        if (!put(out, pos, size, to_base32(bits >> st->nbits & 0x1f)))
+          return false;
+      }
+      st->bits = bits & ((1 << st->nbits) - 1);
+      break;
+    }
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,55 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A compact encoding of otpauth URIs, decodable a fragment at a time.
+ *
+ *   0x00-0x7f  a literal byte
+ *   0x80-0xbc  a phrase from a static dictionary ("otpauth://totp/", ...)
+ *   0xbd b     a literal byte b >= 0x80 (UTF-8)
+ *   0xbe d n   copy n bytes from d bytes back in the output
+ *   0xbf       unused
+ *   0xc0-0xff  a run of 1-64 base32 characters, packed five bits each
+ */
+
+typedef struct {
+  uint8_t op;     /* The code still waiting for its operands. */
+  uint8_t need;   /* Operand bytes still to come. */
+  uint8_t arg;
+  uint8_t bits;   /* Pending base32 bits, and how many. */
+  uint8_t nbits;
+} pack_state;
+
+/* Packs len bytes of in; returns the packed size, or 0 if it won't fit. */
+size_t
+pack(const char *in, size_t len, uint8_t *out, size_t size);
+
+/*
+ * Unpacks len more bytes of a packed stream, appending to out at *pos. The
+ * output written so far must be left in place; copies refer back to it.
+ */
+bool
+unpack(pack_state *st, const uint8_t *in, size_t len,
+       char *out, size_t *pos, size_t size);
@@ -0,0 +1,171 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sched.h"
+
+#include <pebble.h>
+
+#define SCHED_MAX    8
+#define SCHED_BUDGET 20 /* Milliseconds of work per slice. */
+#define SCHED_YIELD  10 /* Milliseconds between slices. */
+
+struct task {
+  sched_step step;
+  void *data;
+  uint32_t seq;
+  sched_prio prio;
+};
+
+static struct task tasks[SCHED_MAX];
+static sched_stats stats;
+static AppTimer *timer;
+static uint32_t seq;
+
+static uint32_t
+now_ms(void)
+{
+  uint16_t ms;
+  time_t s;
+
+  time_ms(&s, &ms);
+  return s * 1000 + ms;
+}
+
+static struct task *
+next(void)
+{
+  struct task *t = NULL;
+
+  for (size_t i = 0; i < SCHED_MAX; i++) {
+    if (!tasks[i].step)
+      continue;
+
+    if (!t || tasks[i].prio < t->prio ||
+        (tasks[i].prio == t->prio && tasks[i].seq < t->seq))
+      t = &tasks[i];
+  }
+
+  return t;
+}
+
+static void run(void *data);
+
+static void
+arm(uint32_t delay)
+{
+  if (timer || stats.depth == 0)
+    return;
+
+  timer = app_timer_register(delay, run, NULL);
+}
+
+static void
+run(void *data)
+{
+  uint32_t start = now_ms();
+  uint32_t elapsed;
+  struct task *t;
+
+  timer = NULL;
+  stats.slices++;
+
+  while ((t = next())) {
+    sched_step step = t->step;
+    void *tdata = t->data;
+    bool done;
+
+    stats.steps++;
+    done = step(tdata);
+
+    // The step may have cancelled itself; only touch the slot if it is ours.
+    if (t->step == step && t->data == tdata) {
+      if (done) {
+        memset(t, 0, sizeof(*t));
+        stats.depth--;
+      } else {
+        t->seq = seq++; // Round robin within a priority.
+      }
+    }
+
+    if (now_ms() - start >= SCHED_BUDGET)
+      break;
+  }
+
+  elapsed = now_ms() - start;
+  if (elapsed > stats.worst)
+    stats.worst = elapsed;
+
+  if (elapsed > SCHED_BUDGET) {
+    stats.overruns++;
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Slice overran: %u ms (depth: %u)",
+            (unsigned) elapsed, stats.depth);
+  }
+
+  arm(SCHED_YIELD);
+}
+
+bool
+sched_add(sched_prio prio, sched_step step, void *data)
+{
+  struct task *t = NULL;
+
+  for (size_t i = 0; i < SCHED_MAX; i++) {
+    // Already queued; coalesce.
+    if (tasks[i].step == step && tasks[i].data == data)
+      return true;
+
+    if (!t && !tasks[i].step)
+      t = &tasks[i];
+  }
+
+  if (!t) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Scheduler queue is full!");
+    return false;
+  }
+
+  *t = (struct task) { step, data, seq++, prio };
+  if (++stats.depth > stats.peak)
+    stats.peak = stats.depth;
+
+  arm(0);
+  return true;
+}
+
+void
+sched_cancel(sched_step step, void *data)
+{
+  for (size_t i = 0; i < SCHED_MAX; i++) {
+    if (tasks[i].step == step && tasks[i].data == data) {
+      memset(&tasks[i], 0, sizeof(tasks[i]));
+      stats.depth--;
+    }
+  }
+
+  if (timer && stats.depth == 0) {
+    app_timer_cancel(timer);
+    timer = NULL;
+  }
+}
+
+void
+sched_get_stats(sched_stats *out)
+{
+  *out = stats;
+}
@@ -0,0 +1,61 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A cooperative scheduler on top of the app event loop.
+ *
+ * Long jobs are split into steps. Each slice runs steps, highest priority
+ * first, until its time budget is spent; then the scheduler yields to the
+ * event loop so that clicks and redraws are serviced between slices.
+ *
+ * The code window computes its codes this way, and msg.c parses and
+ * stores a batch of tokens one token per step.
+ */
+
+typedef enum {
+  SCHED_PRIO_HIGH,
+  SCHED_PRIO_NORMAL,
+  SCHED_PRIO_LOW,
+} sched_prio;
+
+/* Performs one bounded unit of work. Returns true when the task is done. */
+typedef bool (*sched_step)(void *data);
+
+typedef struct {
+  uint32_t slices;
+  uint32_t steps;
+  uint32_t overruns; /* Slices which exceeded the budget. */
+  uint32_t worst;    /* Longest slice, in milliseconds. */
+  uint8_t depth;     /* Tasks currently queued. */
+  uint8_t peak;      /* Deepest the queue has been. */
+} sched_stats;
+
+bool
+sched_add(sched_prio prio, sched_step step, void *data);
+
+void
+sched_cancel(sched_step step, void *data);
+
+void
+sched_get_stats(sched_stats *stats);
@@ -0,0 +1,126 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "token.h"
+#include "hash/murmur3.h"
+
+#include <string.h>
+
+#define MIN(x, y) ({ \
+    __typeof__(x) __x = x; \
+    __typeof__(y) __y = y; \
+    __x < __y ? __x : __y; \
+  })
+
+static void
+decode_string(char *dst, size_t size, const uint8_t *val, uint8_t len)
+{
+  len = MIN(len, size - 1);
+  memcpy(dst, val, len);
+  dst[len] = '\0';
+}
+
+bool
+token_decode(const uint8_t *buf, size_t len, token *t)
+{
+  murmur3_ctx id;
+
+  // Set defaults.
+  memset(t, 0, sizeof(*t));
+  t->hash = HASH_TYPE_SHA1;
+  t->period = 30;
+  t->digits = 6;
+
+  for (size_t i = 0; i < len; ) {
+    const uint8_t *val = &buf[i + 2];
+    uint8_t tag;
+    uint8_t vlen;
+
+    if (i + 2 > len)
+      return false;
+
+    tag = buf[i];
+    vlen = buf[i + 1];
+    i += 2 + vlen;
+    if (i > len)
+      return false;
+
+    switch (tag) {
+    case TOKEN_TLV_TYPE:
+      if (vlen != 1 || (val[0] != TOKEN_TYPE_TOTP && val[0] != TOKEN_TYPE_HOTP))
+        return false;
+      t->type = val[0];
+      break;
+
+    case TOKEN_TLV_ISSUER:
+      decode_string(t->issuer, sizeof(t->issuer), val, vlen);
+      break;
+
+    case TOKEN_TLV_NAME:
+      decode_string(t->name, sizeof(t->name), val, vlen);
+      break;
+
+    case TOKEN_TLV_SECRET:
+      if (vlen > sizeof(t->secret))
+        return false;
+      memcpy(t->secret, val, vlen);
+      t->seclen = vlen;
+      break;
+
+    case TOKEN_TLV_ALGORITHM:
+      if (vlen != 1 || !hash_spec_get(val[0]))
+        return false;
+      t->hash = val[0];
+      break;
+
+    case TOKEN_TLV_DIGITS:
+      if (vlen != 1 || val[0] < 1 || val[0] > sizeof(((code *) 0)->code) - 1)
+        return false;
+      t->digits = val[0];
+      break;
+
+    case TOKEN_TLV_PERIOD:
+      if (vlen != 1 || val[0] == 0)
+        return false;
+      t->period = val[0];
+      break;
+
+    case TOKEN_TLV_COUNTER:
+      if (vlen > sizeof(t->counter))
+        return false;
+      for (uint8_t j = 0; j < vlen; j++)
+        t->counter = t->counter << 8 | val[j];
+      break;
+    }
+  }
+
+  // Same id as the equivalent otpauth URI: murmur3 of "issuer:name".
+  murmur3_init(&id);
+  if (t->issuer[0] != '\0') {
+    murmur3_update(&id, t->issuer, strlen(t->issuer));
+    murmur3_update(&id, ":", 1);
+  }
+  murmur3_update(&id, t->name, strlen(t->name));
+  t->id = murmur3_finish(&id);
+  t->kernel = hotp_kernel_find(t->hash, t->digits);
+
+  // The secret is required.
+  return t->seclen > 0;
+}
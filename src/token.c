@@ -19,10 +19,8 @@
  */
 
 #include "token.h"
-#include "hash/hmac.h"
-#include "hash/murmur3.h"
-#include "base32.h"
-#include "libc.h"
+#include "hotp.h"
+#include "uri.h"
 
 #include <pebble.h>
 
@@ -40,84 +38,10 @@ struct persist {
 };
 
 struct order {
-  uint32_t tokens[8];
+  uint32_t tokens[TOKEN_MAX];
   uint8_t used;
 };
 
-static bool
-hotp(const token *t, uint64_t counter, uint32_t *code)
-{
-  uint8_t *digest;
-  size_t dlen;
-
-#ifdef __LITTLE_ENDIAN__
-  // Network byte order
-  counter = (((uint64_t) htonl(counter)) << 32) + htonl(counter >> 32);
-#endif
-
-  // Create digits divisor
-  uint32_t div = 1;
-  for (int i = t->digits; i > 0; i--)
-    div *= 10;
-
-  // Create the HMAC
-  if (!hmac(t->hash, t->secret, t->seclen,
-            &counter, sizeof(counter), &digest, &dlen))
-    return false;
-
-  // Truncate
-  uint32_t binary;
-  uint32_t off = digest[dlen - 1] & 0xf;
-  binary  = (digest[off + 0] & 0x7f) << 0x18;
-  binary |= (digest[off + 1] & 0xff) << 0x10;
-  binary |= (digest[off + 2] & 0xff) << 0x08;
-  binary |= (digest[off + 3] & 0xff) << 0x00;
-  *code = binary % div;
-
-  free(digest);
-  return true;
-}
-
-static inline int8_t
-decode_digit(char c)
-{
-  if (c >= '0' && c <= '9')
-    return c - '0';
-
-  if (c >= 'A' && c <= 'F')
-    return c - 'A' + 10;
-
-  if (c >= 'a' && c <= 'f')
-    return c - 'a' + 10;
-
-  return -1;
-}
-
-static void
-decode(char *str)
-{
-  for (size_t i = 0; str[i]; i++) {
-    if (str[i] != '%')
-      continue;
-
-    int8_t u = decode_digit(str[i + 1]);
-    if (u < 0)
-      continue;
-
-    int8_t l = decode_digit(str[i + 2]);
-    if (l < 0)
-      continue;
-
-    if (u == 0 && l == 0)
-      continue;
-
-    size_t len = strlen(&str[i + 3]);
-    str[i] = (u << 4) | l;
-    memmove(&str[i + 1], &str[i + 3], len);
-    str[i + 1 + len] = '\0';
-  }
-}
-
 bool
 token_exists(const token *t)
 {
@@ -146,69 +70,113 @@ token_exists(const token *t)
 bool
 token_add(const token *t)
 {
-  struct persist p = { VERSION, *t };
+  uint8_t result;
+
+  return token_add_batch(t, 1, &result) == 1;
+}
+
+uint8_t
+token_add_batch(const token *t, uint8_t n, uint8_t *result)
+{
   struct order o = {{}, 0};
+  uint8_t used;
 
-  // Token cannot share an id with the order struct.
-  if (t->id == ORDER)
-    return false;
+  memset(result, TOKEN_ADD_FAILED, n);
 
   // Load existing persistence order.
   if (persist_exists(ORDER)) {
     if (persist_read_data(ORDER, &o, sizeof(o)) != sizeof(o))
-      return false;
+      return 0;
   }
+  used = o.used;
 
-  // If token exists, error.
-  for (size_t i = 0; i < o.used; i++) {
-    if (o.tokens[i] == t->id)
-      return false;
-  }
-  
-  // If we are full, error.
-  if (o.used >= sizeof(o.tokens) / sizeof(*o.tokens))
-    return false;
+  for (uint8_t i = 0; i < n; i++) {
+    struct persist p = { VERSION, t[i] };
+    size_t j;
 
-  // If write fails, error.
-  if (persist_write_data(p.token.id, &p, sizeof(p)) != sizeof(p))
-    return false;
+    // Token cannot share an id with the order struct.
+    if (t[i].id == ORDER)
+      continue;
+
+    // If token exists (perhaps earlier in this batch), skip it.
+    result[i] = TOKEN_ADD_EXISTS;
+    for (j = 0; j < o.used && o.tokens[j] != t[i].id; j++)
+      continue;
+    if (j < o.used)
+      continue;
+
+    // If we are full, skip it.
+    result[i] = TOKEN_ADD_FULL;
+    if (o.used >= TOKEN_MAX)
+      continue;
+
+    // If write fails, skip it.
+    result[i] = TOKEN_ADD_FAILED;
+    if (persist_write_data(p.token.id, &p, sizeof(p)) != sizeof(p))
+      continue;
+
+    // Add the token to the start of the order (reverse order).
+    result[i] = TOKEN_ADD_OK;
+    o.tokens[o.used++] = p.token.id;
+  }
 
-  // Add the token to the start of the order (reverse order).
-  o.tokens[o.used++] = p.token.id;
+  if (o.used == used)
+    return 0;
 
-  // If order write fails, error.
+  // If order write fails, remove the tokens written above.
   if (persist_write_data(ORDER, &o, sizeof(o)) != sizeof(o)) {
-    persist_delete(p.token.id); // Remove token.
-    return false;
+    for (uint8_t i = used; i < o.used; i++)
+      persist_delete(o.tokens[i]);
+    for (uint8_t i = 0; i < n; i++) {
+      if (result[i] == TOKEN_ADD_OK)
+        result[i] = TOKEN_ADD_FAILED;
+    }
+    return 0;
   }
 
-  return true;
+  return o.used - used;
 }
 
 bool
 token_del(token *t)
+{
+  return token_del_ids(&t->id, 1) == 1;
+}
+
+uint8_t
+token_del_ids(const uint32_t *ids, uint8_t n)
 {
   struct order o = {{}, 0};
-  bool found = false;
- 
+  uint32_t gone[TOKEN_MAX];
+  uint8_t used = 0;
+  uint8_t g = 0;
+
   if (persist_read_data(ORDER, &o, sizeof(o)) != sizeof(o))
-    return false;
+    return 0;
+
+  // Keep every token not listed in ids.
+  for (uint8_t i = 0; i < o.used; i++) {
+    bool found = false;
+
+    for (uint8_t k = 0; k < n && !found; k++)
+      found = o.tokens[i] == ids[k];
 
-  for (int8_t i = 0; i < o.used; i++) {
     if (found)
-      o.tokens[i - 1] = o.tokens[i];
-    if (o.tokens[i] == t->id)
-      found = true;
+      gone[g++] = o.tokens[i];
+    else
+      o.tokens[used++] = o.tokens[i];
   }
-  if (!found)
-    return false;
+  if (g == 0)
+    return 0;
 
-  o.used--;
+  o.used = used;
   if (persist_write_data(ORDER, &o, sizeof(o)) != sizeof(o))
-    return false;
+    return 0;
 
-  persist_delete(t->id);
-  return true;
+  for (uint8_t i = 0; i < g; i++)
+    persist_delete(gone[i]);
+
+  return g;
 }
 
 bool
@@ -230,6 +198,7 @@ token_get(int8_t pos, token *t)
     return false;
 
   *t = p.token;
+  t->kernel = hotp_kernel_find(t->hash, t->digits);
   return true;
 }
 
@@ -244,6 +213,20 @@ token_count(void)
   return o.used;
 }
 
+uint8_t
+token_ids(uint32_t ids[TOKEN_MAX])
+{
+  struct order o = {{}, 0};
+
+  if (persist_read_data(ORDER, &o, sizeof(o)) != sizeof(o))
+    return 0;
+
+  for (uint8_t i = 0; i < o.used; i++)
+    ids[i] = o.tokens[o.used - i - 1];
+
+  return o.used;
+}
+
 int8_t
 token_position(const token *t)
 {
@@ -290,146 +273,63 @@ token_move(int8_t from, int8_t to)
 }
 
 bool
-token_code(token *t, code c[2])
+token_code(token *t, time_t now, code *c)
 {
   const uint32_t period = t->period ? t->period : 30;
-  struct persist p = {VERSION, *t};
-  time_t now = time(NULL);
-  char tmpl[16];
-  uint32_t num;
-
-  snprintf(tmpl, sizeof(tmpl), "%%0%ud",
-           MIN(t->digits, sizeof(c[0].code)));
+  uint64_t counter;
 
   if (now == (time_t) - 1)
     return false;
 
-  p.token.counter++;
-  if (persist_write_data(t->id, &p, sizeof(p)) != sizeof(p))
-    return false;
-
   switch (t->type) {
-  case TOKEN_TYPE_HOTP:
-    if (!hotp(t, t->counter, &num))
-      return false;
-    snprintf(c[0].code, sizeof(c[0].code), tmpl, num);
-    c[0].start = now;
-    c[0].until = now + period;
-    memset(&c[1], 0, sizeof(c[1]));
-    break;
-  case TOKEN_TYPE_TOTP:
-    now /= period;
+  case TOKEN_TYPE_HOTP: {
+    struct persist p = {VERSION, *t};
 
-    if (!hotp(t, now, &num))
+    // Only HOTP consumes state; persist it before revealing the code.
+    p.token.counter++;
+    if (persist_write_data(t->id, &p, sizeof(p)) != sizeof(p))
       return false;
-    snprintf(c[0].code, sizeof(c[0].code), tmpl, num);
-    c[0].start = now * period;
-    c[0].until = ++now * period;
 
-    if (!hotp(t, now, &num))
-      return false;
-    snprintf(c[1].code, sizeof(c[1].code), tmpl, num);
-    c[1].start = now * period;
-    c[1].until = ++now * period;
+    counter = t->counter++;
+    c->start = now;
+    c->until = now + period;
     break;
   }
+  case TOKEN_TYPE_TOTP:
+    counter = now / period;
+    c->start = counter * period;
+    c->until = c->start + period;
+    break;
+  default:
+    return false;
+  }
 
-  t->counter++;
-  return true;  
+  if (t->kernel) {
+    t->kernel(t->secret, t->seclen, counter, c->code);
+    return true;
+  }
+
+  return hotp(t->hash, MIN(t->digits, sizeof(c->code) - 1),
+              t->secret, t->seclen, counter, c->code, sizeof(c->code));
 }
 
-bool                        
+bool
 token_parse(const char *url, token *t)
 {
-  bool success = false;
-  char *state = NULL;
-  size_t tokcnt = 0;
-  char *pos = NULL;
-  char *buf = NULL;
-
-  // Set defaults.
-  memset(t, 0, sizeof(*t));
-  t->hash = HASH_TYPE_SHA1;
-  t->period = 30;
-  t->digits = 6;
-
-  // Copy url into local buffer for modification.
-  buf = __strdup(url);
-  if (!buf)
-    goto error;
-
-  for (char *itr = __strtok_r(buf,  "/?&=", &state);
-        itr; itr = __strtok_r(NULL, "/?&=", &state)) {
-    decode(itr);
-    
-    switch (tokcnt++) {
-    case 0: // Scheme
-      if (__strcasecmp("otpauth:", itr) != 0)
-        goto error;
-      break;
-
-    case 1: // Type
-      if (__strcasecmp("totp", itr) == 0)
-        t->type = TOKEN_TYPE_TOTP;
-      else if (__strcasecmp("hotp", itr) == 0)
-        t->type = TOKEN_TYPE_HOTP;
-      else
-        goto error;
-      break;
-
-    case 2: // Label
-      t->id = murmur3_32(itr, strlen(itr));
-
-      pos = strchr(itr, ':');
-      if (pos)
-        *pos++ = '\0';
-
-      snprintf(t->name, sizeof(t->name), "%s", pos ? pos : itr);
-      if (pos)
-        snprintf(t->issuer, sizeof(t->issuer), "%s", itr);
-      break;
-
-    default: // Query parameters
-      if (tokcnt % 2 == 0) {
-        pos = itr;
-        break;
-      }
-
-      if (strcmp("secret", pos) == 0) {
-        int i = base32_decode(itr, t->secret, sizeof(t->secret));
-        if (i < 0)
-          goto error;
-        t->seclen = i;
-      } else if (strcmp("issuer", pos) == 0) {
-        size_t lsize = strlen(itr) + strlen(t->name) + 2;
-        char *tmp = malloc(lsize);
-        if (!tmp)
-          goto error;
-        snprintf(tmp, lsize, "%s:%s", itr, t->name);
-        t->id = murmur3_32(tmp, strlen(tmp));
-        free(tmp);
-      } else if (strcmp("algorithm", pos) == 0) {
-        t->hash = hash_type_find(itr);
-        if (t->hash == HASH_TYPE_UNKNOWN)
-          t->hash = HASH_TYPE_SHA1;
-      } else if (strcmp("digits", pos) == 0) {
-        if (itr[0] == '8' && itr[1] == '\0')
-          t->digits = 8;
-      } else if (strcmp("counter", pos) == 0) {
-        t->counter = atoi(itr);
-      } else if (strcmp("period", pos) == 0) {
-        int i = atoi(itr);
-        if (i != 0)
-          t->period = i;
-      }
-      break;
-    }
-  }
+  uri_parser p;
+
+  // The parser stops at the NUL, so there's no need to measure url first.
+  uri_init(&p, t);
+  uri_feed(&p, url, SIZE_MAX);
+  return uri_finish(&p);
+}
 
-  // The secret is required.
-  success = t->seclen > 0;
+bool
+token_parsen(const char *url, size_t len, token *t)
+{
+  uri_parser p;
 
-error:
-  free(buf);
-  return success;
+  uri_init(&p, t);
+  uri_feed(&p, url, len);
+  return uri_finish(&p);
 }
@@ -23,10 +23,34 @@
 #include <stdbool.h>
 #include <time.h>
 #include "hash/hash.h"
+#include "hotp.h"
+
+#define TOKEN_MAX 8 /* Tokens the store can hold. */
 
 #define TOKEN_TYPE_TOTP 0
 #define TOKEN_TYPE_HOTP 1
 
+/*
+ * Tags of the binary token encoding: a sequence of (tag, length, value)
+ * triples with one byte tags and lengths. Unknown tags are skipped.
+ */
+#define TOKEN_TLV_END       0 /* Ends one token of a batch (zero length) */
+#define TOKEN_TLV_TYPE      1 /* TOKEN_TYPE_* (1 byte) */
+#define TOKEN_TLV_ISSUER    2 /* UTF-8, without NUL */
+#define TOKEN_TLV_NAME      3 /* UTF-8, without NUL */
+#define TOKEN_TLV_SECRET    4 /* Raw key bytes */
+#define TOKEN_TLV_ALGORITHM 5 /* hash_type (1 byte) */
+#define TOKEN_TLV_DIGITS    6 /* 1 byte */
+#define TOKEN_TLV_PERIOD    7 /* Seconds (1 byte) */
+#define TOKEN_TLV_COUNTER   8 /* Big endian, up to 8 bytes */
+
+/* Outcome of adding one token of a batch; see token_add_batch(). */
+#define TOKEN_ADD_OK      0
+#define TOKEN_ADD_EXISTS  1
+#define TOKEN_ADD_FULL    2
+#define TOKEN_ADD_FAILED  3
+#define TOKEN_ADD_INVALID 4 /* Never stored; for callers that fail parsing. */
+
 typedef struct token token;
 typedef struct code code;
 
@@ -41,6 +65,7 @@ struct token {
   uint8_t digits;
   uint8_t hash; /* We don't use the enum so we can specify storage. */
   uint8_t type;
+  hotp_kernel kernel; /* For hash and digits; set again whenever loaded. */
 };
 
 struct code {
@@ -55,12 +80,27 @@ token_exists(const token *t);
 bool
 token_add(const token *t);
 
+/*
+ * Adds n tokens, committing them with a single write of the stored order.
+ * Sets result[i] to a TOKEN_ADD_* value and returns the number added.
+ */
+uint8_t
+token_add_batch(const token *t, uint8_t n, uint8_t *result);
+
 bool
 token_del(token *t);
 
+/* Deletes tokens by id with a single order update; returns the number. */
+uint8_t
+token_del_ids(const uint32_t *ids, uint8_t n);
+
 bool
 token_get(int8_t pos, token *t);
 
+/* Copies the ids of the stored tokens, in display order; returns the count. */
+uint8_t
+token_ids(uint32_t ids[TOKEN_MAX]);
+
 uint8_t
 token_count(void);
 
@@ -71,7 +111,15 @@ bool
 token_move(int8_t from, int8_t to);
 
 bool
-token_code(token *t, code c[2]);
+token_code(token *t, time_t now, code *c);
 
 bool
 token_parse(const char *url, token *t);
+
+/* Like token_parse(), but url is len bytes rather than NUL terminated. */
+bool
+token_parsen(const char *url, size_t len, token *t);
+
+/* Decodes the TOKEN_TLV_* binary encoding of a token. */
+bool
+token_decode(const uint8_t *buf, size_t len, token *t);
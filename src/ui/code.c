@@ -19,8 +19,10 @@
  */
 
 #include "code.h"
+#include "../sched.h"
 
 #define count(a) (sizeof(a) / sizeof(*(a)))
+#define LEAD 2 /* Seconds before a boundary to compute the next code. */
 #define abs(v) ({ __typeof__(v) __x = v; __x < 0 ? 0 - __x : __x; })
 
 typedef struct {
@@ -37,9 +39,26 @@ typedef struct {
     GBitmap *delete;
     GBitmap *cancel;
   } icons;
+  uint8_t bar; /* Width of the progress bar, in pixels. */
+  struct {
+    time_t since;
+    uint32_t wakeups;
+    uint32_t opened; /* When the last bind happened, in ms; 0 once drawn. */
+  } stats;
   AppTimer *timer;
+  Window *window;
 } user_data;
 
+static uint32_t
+now_ms(void)
+{
+  uint16_t ms;
+  time_t s;
+
+  time_ms(&s, &ms);
+  return s * 1000 + ms;
+}
+
 static inline GRect
 rect(Layer *layer, uint8_t width, int8_t height)
 {
@@ -47,24 +66,11 @@ rect(Layer *layer, uint8_t width, int8_t height)
   int16_t h = f.size.h * abs(height) / 100; 
   f.origin.x = 0;
   f.origin.y = height < 0 ? f.size.h - h : 0;
-  f.size.w = f.size.w * width / 100;
+  f.size.w = width;
   f.size.h = h;
   return f;
 }
 
-static time_t
-last(const user_data *ud)
-{
-  time_t last = 0;
-  for (size_t j = count(ud->codes); j > 0; j--) {
-    last = ud->codes[j - 1].until;
-    if (last != 0)
-      break;
-  }
-
-  return last;
-}
-
 static const code *
 active(const user_data *ud, time_t now)
 {
@@ -78,25 +84,39 @@ active(const user_data *ud, time_t now)
   return NULL;
 }
 
+static uint8_t
+width(const user_data *ud, time_t now)
+{
+  int16_t w = layer_get_frame(ud->layers.progress).size.w;
+  const code *c = active(ud, now);
+
+  if (!c)
+    return 0;
+
+  return w * (100 - (now - c->start) * 100 / (c->until - c->start)) / 100;
+}
+
 static void
 progress(Layer *layer, GContext *ctx)
 {
   Window *w = layer_get_window(layer);
   user_data *ud = window_get_user_data(w);
+  uint8_t full = layer_get_frame(layer).size.w;
+
+  if (ud->stats.opened != 0) {
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Code window: first frame after %u ms",
+            (unsigned) (now_ms() - ud->stats.opened));
+    ud->stats.opened = 0;
+  }
 
   graphics_context_set_stroke_color(ctx, GColorBlack);
   graphics_context_set_fill_color(ctx, GColorBlack);  
   
-  graphics_draw_round_rect(ctx, rect(layer, 100, 100), 3);
+  graphics_draw_round_rect(ctx, rect(layer, full, 100), 3);
 
-  time_t now = time(NULL);
-  const code *c = active(ud, now);
-  if (c) {
-    uint8_t ptop = 100 - (now - c->start) * 100 / (c->until - c->start);
-    uint8_t pbot = 100 - (now - ud->codes[0].start) * 100 / (last(ud) - ud->codes[0].start);
-    graphics_fill_rect(ctx, rect(layer, ptop, 50), 3, ptop > 99 ? GCornersTop : GCornerTopLeft);
-    graphics_fill_rect(ctx, rect(layer, pbot, -50), 3, pbot > 99 ? GCornersBottom : GCornerBottomLeft);
-  }
+  // The width is computed when the timer fires, not on every draw.
+  graphics_fill_rect(ctx, rect(layer, ud->bar, 100), 3,
+                     ud->bar >= full ? GCornersAll : GCornersLeft);
 }
 
 static void
@@ -142,49 +162,31 @@ click_config_provider(void *context)
   window_long_click_subscribe(BUTTON_ID_SELECT, 0, long_click, NULL);
 }
 
-static void
-load(Window *window)
+static bool
+layers_create(user_data *ud, Window *window)
 {
-  user_data *ud = window_get_user_data(window);
   Layer *l = window_get_root_layer(window);
-  GRect f = layer_get_frame(l);
 
-  // Set padding.
-  f.origin.x += 6;
-  f.size.w -= 12;
-  
-  // Setup progress.
-  f.origin.y = (f.size.h - 28 - 28 - 22) / 2 - 8;
-  f.size.h = 8;
-  ud->layers.progress = layer_create(f);
+  // Frames are set on load, from the root layer's bounds.
+  ud->layers.progress = layer_create(GRectZero);
+  ud->layers.code = text_layer_create(GRectZero);
+  ud->layers.issuer = text_layer_create(GRectZero);
+  ud->layers.name = text_layer_create(GRectZero);
+  ud->layers.abl = action_bar_layer_create();
+  if (!ud->layers.progress || !ud->layers.code || !ud->layers.issuer ||
+      !ud->layers.name || !ud->layers.abl)
+    return false;
+
   layer_set_update_proc(ud->layers.progress, progress);
-  
-  // Setup code.
-  f.origin.y += 16;
-  f.size.h = 28;
-  ud->layers.code = text_layer_create(f);
   text_layer_set_font(ud->layers.code,
                       fonts_get_system_font(FONT_KEY_DROID_SERIF_28_BOLD));
-  update_code(ud);
-
-  // Setup issuer.
-  f.origin.y += f.size.h;
-  f.size.h = 28;
-  ud->layers.issuer = text_layer_create(f);
   text_layer_set_overflow_mode(ud->layers.issuer, GTextOverflowModeTrailingEllipsis);
   text_layer_set_font(ud->layers.issuer,
                       fonts_get_system_font(FONT_KEY_GOTHIC_24_BOLD));
-  text_layer_set_text(ud->layers.issuer, ud->token.issuer);
-  
-  // Setup name.
-  f.origin.y += f.size.h;
-  f.size.h = 22;
-  ud->layers.name = text_layer_create(f);
   text_layer_set_overflow_mode(ud->layers.name, GTextOverflowModeTrailingEllipsis);
   text_layer_set_font(ud->layers.name,
                       fonts_get_system_font(FONT_KEY_GOTHIC_18));
-  text_layer_set_text(ud->layers.name, ud->token.name);
-  
+
   // Add layers.
   layer_add_child(l, text_layer_get_layer(ud->layers.issuer));
   layer_add_child(l, text_layer_get_layer(ud->layers.name));
@@ -192,47 +194,201 @@ load(Window *window)
   layer_add_child(l, ud->layers.progress);
 
   // Setup action bar.
-  ud->layers.abl = action_bar_layer_create();
   action_bar_layer_set_context(ud->layers.abl, ud);
   action_bar_layer_set_click_config_provider(ud->layers.abl, click_config_provider);
   action_bar_layer_set_icon(ud->layers.abl, BUTTON_ID_UP, ud->icons.delete);
   action_bar_layer_set_icon(ud->layers.abl, BUTTON_ID_DOWN, ud->icons.cancel);
   action_bar_layer_add_to_window(ud->layers.abl, window);
   layer_set_hidden(action_bar_layer_get_layer(ud->layers.abl), true);
+  return true;
+}
+
+static void
+load(Window *window)
+{
+  user_data *ud = window_get_user_data(window);
+  GRect f = layer_get_bounds(window_get_root_layer(window));
+
+  // Set padding.
+  f.origin.x += 6;
+  f.size.w -= 12;
+  
+  // Setup progress.
+  f.origin.y = (f.size.h - 28 - 28 - 22) / 2 - 8;
+  f.size.h = 8;
+  layer_set_frame(ud->layers.progress, f);
+  
+  // Setup code.
+  f.origin.y += 16;
+  f.size.h = 28;
+  layer_set_frame(text_layer_get_layer(ud->layers.code), f);
+
+  // Setup issuer.
+  f.origin.y += f.size.h;
+  f.size.h = 28;
+  layer_set_frame(text_layer_get_layer(ud->layers.issuer), f);
+  
+  // Setup name.
+  f.origin.y += f.size.h;
+  f.size.h = 22;
+  layer_set_frame(text_layer_get_layer(ud->layers.name), f);
 }
 
+static bool
+precompute(void *data)
+{
+  user_data *ud = data;
+  code *nxt = &ud->codes[1];
+
+  if (nxt->until == 0 && !token_code(&ud->token, ud->codes[0].until, nxt))
+    memset(nxt, 0, sizeof(*nxt));
+
+  return true;
+}
+
+static bool
+roll(user_data *ud, time_t now)
+{
+  code *cur = &ud->codes[0];
+  code *nxt = &ud->codes[1];
+
+  if (now >= cur->until) {
+    // HOTP codes are single use; they do not roll over.
+    if (ud->token.type != TOKEN_TYPE_TOTP)
+      return false;
+
+    // We may have missed the precompute (i.e. a late wakeup).
+    if (nxt->until == 0 || now >= nxt->until) {
+      if (!token_code(&ud->token, now, nxt))
+        return false;
+    }
+
+    *cur = *nxt;
+    memset(nxt, 0, sizeof(*nxt));
+  }
+
+  // Compute the next code once, shortly before it is needed.
+  if (ud->token.type == TOKEN_TYPE_TOTP && nxt->until == 0 &&
+      now >= cur->until - LEAD)
+    sched_add(SCHED_PRIO_LOW, precompute, ud);
+
+  return true;
+}
+
+static void tick(void *data);
+
+// Sleep until the bar changes width, the next code is due or the code rolls.
+static void
+schedule(user_data *ud, time_t now, uint16_t ms)
+{
+  const code *cur = &ud->codes[0];
+  time_t t;
+
+  for (t = now + 1; t < cur->until; t++) {
+    if (ud->token.type == TOKEN_TYPE_TOTP && t == cur->until - LEAD)
+      break;
+
+    if (width(ud, t) != ud->bar)
+      break;
+  }
+
+  // Align to the second boundary rather than free-running.
+  ud->timer = app_timer_register((t - now) * 1000 - ms, tick, ud);
+}
+
+static void
+redraw(user_data *ud, time_t now)
+{
+  uint8_t bar = width(ud, now);
+
+  if (bar == ud->bar)
+    return;
+
+  ud->bar = bar;
+  layer_mark_dirty(ud->layers.progress);
+}
 
 static void
 tick(void *data)
 {
   user_data *ud = data;
+  time_t start = ud->codes[0].start;
+  uint16_t ms;
+  time_t now;
 
-  if (time(NULL) >= last(ud)) {
+  ud->timer = NULL;
+  ud->stats.wakeups++;
+  time_ms(&now, &ms);
+
+  if (!roll(ud, now)) {
     window_stack_pop(true);
-    ud->timer = NULL;
     return;
   }
 
+  if (ud->codes[0].start != start)
+    update_code(ud);
+
+  redraw(ud, now);
+  schedule(ud, now, ms);
+}
+
+// Computes the first code after the window is already on its way in.
+static bool
+compute(void *data)
+{
+  user_data *ud = data;
+  uint16_t ms;
+  time_t now;
+
+  time_ms(&now, &ms);
+  if (!token_code(&ud->token, now, &ud->codes[0])) {
+    window_stack_remove(ud->window, true);
+    return true;
+  }
+
   update_code(ud);
-  layer_mark_dirty(ud->layers.progress);
-  ud->timer = app_timer_register(1000, tick, data);
+  redraw(ud, now);
+  if (!ud->timer)
+    schedule(ud, now, ms);
+
+  return true;
 }
 
 static void
 appear(Window *window)
 {
   user_data *ud = window_get_user_data(window);
-  ud->timer = app_timer_register(1000, tick, ud);
+  uint16_t ms;
+  time_t now;
+
+  time_ms(&now, &ms);
+  ud->stats.since = now;
+  ud->stats.wakeups = 0;
+
+  // Until the first code is computed there is nothing to animate.
+  if (ud->codes[0].until == 0 || ud->timer)
+    return;
+
+  redraw(ud, now);
+  schedule(ud, now, ms);
 }
 
 static void
 disappear(Window *window)
 {
   user_data *ud = window_get_user_data(window);
+  time_t elapsed = time(NULL) - ud->stats.since;
+
+  sched_cancel(compute, ud);
   if (ud->timer) {
     app_timer_cancel(ud->timer);
     ud->timer = NULL;
   }
+
+  if (elapsed > 0)
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Code window: %u wakeups in %u s (%u/min)",
+            (unsigned) ud->stats.wakeups, (unsigned) elapsed,
+            (unsigned) (ud->stats.wakeups * 60 / elapsed));
 }
 
 static void
@@ -241,6 +397,9 @@ user_data_free(user_data *ud)
   if (!ud)
     return;
 
+  sched_cancel(precompute, ud);
+  sched_cancel(compute, ud);
+
   if (ud->layers.abl) {
     layer_remove_from_parent(action_bar_layer_get_layer(ud->layers.abl));
     action_bar_layer_destroy(ud->layers.abl);
@@ -273,66 +432,70 @@ user_data_free(user_data *ud)
   free(ud);
 }
 
-static user_data *
-user_data_create(token *t)
-{
-  user_data *ud = malloc(sizeof(*ud));
-  if (!ud)
-    goto error;
-  
-  memset(ud, 0, sizeof(*ud));
-  ud->token = *t;
-
-  if (!token_code(t, ud->codes))
-    goto error;
-
-  ud->icons.cancel = gbitmap_create_with_resource(RESOURCE_ID_CANCEL);
-  if (!ud->icons.cancel)
-    goto error;
-
-  ud->icons.delete = gbitmap_create_with_resource(RESOURCE_ID_DELETE);
-  if (!ud->icons.delete)
-    goto error;
-  
-  return ud;
-
-error:
-  user_data_free(ud);
-  return NULL;
-}
-
-static void
-unload(Window *window)
-{
-  user_data_free(window_get_user_data(window));
-}
-
-
 Window *
-code_create(token *t)
+code_create(void)
 {
   user_data *ud;
   Window *w;
 
-  ud = user_data_create(t);
+  ud = malloc(sizeof(*ud));
   if (!ud)
     return NULL;
+  memset(ud, 0, sizeof(*ud));
 
+  // Decode the icons once; the window is rebound for each token.
+  ud->icons.cancel = gbitmap_create_with_resource(RESOURCE_ID_CANCEL);
+  ud->icons.delete = gbitmap_create_with_resource(RESOURCE_ID_DELETE);
   w = window_create();
-  if (!w) {
+  if (!ud->icons.cancel || !ud->icons.delete || !w ||
+      !layers_create(ud, w)) {
     user_data_free(ud);
+    if (w)
+      window_destroy(w);
     return NULL;
   }
 
+  ud->window = w;
   window_set_user_data(w, ud);
   window_set_click_config_provider_with_context(w, click_config_provider, ud);
   window_set_window_handlers(w, (WindowHandlers) {
     .load = load,
     .appear = appear,
     .disappear = disappear,
-    .unload = unload
   });
 
   return w;
 }
 
+void
+code_bind(Window *window, const token *t)
+{
+  user_data *ud = window_get_user_data(window);
+  uint8_t digits;
+
+  ud->stats.opened = now_ms();
+  sched_cancel(precompute, ud);
+  memset(ud->codes, 0, sizeof(ud->codes));
+  ud->bar = 0;
+  ud->token = *t;
+
+  // Show a placeholder; the HMAC (and HOTP counter write) come later.
+  digits = t->digits < sizeof(ud->codes[0].code) ? t->digits : 0;
+  memset(ud->codes[0].code, '-', digits);
+
+  text_layer_set_text(ud->layers.issuer, ud->token.issuer);
+  text_layer_set_text(ud->layers.name, ud->token.name);
+  text_layer_set_text(ud->layers.code, ud->codes[0].code);
+  layer_set_hidden(action_bar_layer_get_layer(ud->layers.abl), true);
+  sched_add(SCHED_PRIO_HIGH, compute, ud);
+}
+
+void
+code_destroy(Window *window)
+{
+  if (!window)
+    return;
+
+  user_data_free(window_get_user_data(window));
+  window_destroy(window);
+}
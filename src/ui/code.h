@@ -22,4 +22,10 @@
 #include "../token.h"
 
 Window *
-code_create(token *t);
+code_create(void);
+
+void
+code_bind(Window *window, const token *t);
+
+void
+code_destroy(Window *window);
@@ -0,0 +1,252 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dash.h"
+#include "../token.h"
+
+typedef struct user_data user_data;
+
+typedef struct {
+  token token;
+  code code;
+} entry;
+
+/* Tokens sharing a period roll over together; refresh them as one batch. */
+typedef struct {
+  user_data *ud;
+  AppTimer *timer;
+  time_t until;
+  uint8_t period;
+} group;
+
+struct user_data {
+  MenuLayer *ml;
+  TextLayer *tl;
+  entry *entries;
+  group *groups;
+  uint8_t nentries;
+  uint8_t ngroups;
+};
+
+static inline uint8_t
+period(const token *t)
+{
+  return t->period ? t->period : 30;
+}
+
+static void tick(void *data);
+
+static void
+refresh(group *g)
+{
+  user_data *ud = g->ud;
+  uint16_t ms;
+  time_t now;
+
+  time_ms(&now, &ms);
+
+  // If the timer fired early, compute the codes for the coming period.
+  if (now < g->until) {
+    now = g->until;
+    ms = 0;
+  }
+
+  for (size_t i = 0; i < ud->nentries; i++) {
+    entry *e = &ud->entries[i];
+
+    if (period(&e->token) != g->period)
+      continue;
+
+    if (!token_code(&e->token, now, &e->code))
+      snprintf(e->code.code, sizeof(e->code.code), "-");
+  }
+
+  // Wake up exactly at the next boundary of this period.
+  g->until = (now / g->period + 1) * g->period;
+  g->timer = app_timer_register((g->until - now) * 1000 - ms, tick, g);
+}
+
+static void
+tick(void *data)
+{
+  group *g = data;
+
+  g->timer = NULL;
+  refresh(g);
+  layer_mark_dirty(menu_layer_get_layer(g->ud->ml));
+}
+
+static void
+menu_draw_row(GContext *ctx, const Layer *cell_layer, MenuIndex *cell_index, void *callback_context)
+{
+  user_data *ud = callback_context;
+  const entry *e = &ud->entries[cell_index->row];
+
+  menu_cell_basic_draw(ctx, cell_layer, e->code.code,
+                       e->token.issuer[0] ? e->token.issuer : e->token.name,
+                       NULL);
+}
+
+static uint16_t
+menu_get_num_rows(MenuLayer *menu_layer, uint16_t section_index, void *callback_context)
+{
+  user_data *ud = callback_context;
+  return ud->nentries;
+}
+
+static bool
+load_entries(user_data *ud)
+{
+  uint8_t count = token_count();
+
+  ud->entries = malloc(sizeof(*ud->entries) * count);
+  ud->groups = malloc(sizeof(*ud->groups) * count);
+  if (count > 0 && (!ud->entries || !ud->groups))
+    return false;
+
+  for (uint8_t i = 0; i < count; i++) {
+    entry *e = &ud->entries[ud->nentries];
+    size_t j;
+
+    // HOTP codes consume the counter, so only TOTP tokens are shown.
+    if (!token_get(i, &e->token) || e->token.type != TOKEN_TYPE_TOTP)
+      continue;
+
+    memset(&e->code, 0, sizeof(e->code));
+    ud->nentries++;
+
+    for (j = 0; j < ud->ngroups; j++) {
+      if (ud->groups[j].period == period(&e->token))
+        break;
+    }
+
+    if (j == ud->ngroups)
+      ud->groups[ud->ngroups++] = (group) { ud, NULL, 0, period(&e->token) };
+  }
+
+  return true;
+}
+
+static void
+load(Window *window)
+{
+  Layer *rl = window_get_root_layer(window);
+  user_data *ud;
+  Layer *l;
+  GRect f;
+  GSize s;
+
+  ud = malloc(sizeof(*ud));
+  if (!ud)
+    return;
+  *ud = (user_data) {};
+  window_set_user_data(window, ud);
+
+  if (!load_entries(ud))
+    ud->nentries = 0;
+
+  ud->tl = text_layer_create(layer_get_bounds(rl));
+  text_layer_set_text(ud->tl, "There are no time-based tokens.");
+  text_layer_set_text_alignment(ud->tl, GTextAlignmentCenter);
+  text_layer_set_overflow_mode(ud->tl, GTextOverflowModeWordWrap);
+  s = text_layer_get_content_size(ud->tl);
+  l = text_layer_get_layer(ud->tl);
+  f = layer_get_frame(l);
+  f.origin.y = (f.size.h - s.h) / 2;
+  f.size.h = s.h;
+  layer_set_frame(l, f);
+  layer_set_hidden(l, ud->nentries != 0);
+
+  ud->ml = menu_layer_create(layer_get_bounds(rl));
+  layer_set_hidden(menu_layer_get_layer(ud->ml), ud->nentries == 0);
+  menu_layer_set_click_config_onto_window(ud->ml, window);
+  menu_layer_set_callbacks(ud->ml, ud, (MenuLayerCallbacks) {
+    .draw_row = menu_draw_row,
+    .get_num_rows = menu_get_num_rows,
+  });
+
+  layer_add_child(rl, menu_layer_get_layer(ud->ml));
+  layer_add_child(rl, text_layer_get_layer(ud->tl));
+}
+
+static void
+appear(Window *window)
+{
+  user_data *ud = window_get_user_data(window);
+
+  // Without memory, load() left the window empty.
+  if (!ud)
+    return;
+
+  for (size_t i = 0; i < ud->ngroups; i++) {
+    ud->groups[i].until = 0;
+    refresh(&ud->groups[i]);
+  }
+
+  menu_layer_reload_data(ud->ml);
+}
+
+static void
+disappear(Window *window)
+{
+  user_data *ud = window_get_user_data(window);
+
+  if (!ud)
+    return;
+
+  for (size_t i = 0; i < ud->ngroups; i++) {
+    if (ud->groups[i].timer) {
+      app_timer_cancel(ud->groups[i].timer);
+      ud->groups[i].timer = NULL;
+    }
+  }
+}
+
+static void
+unload(Window *window)
+{
+  user_data *ud = window_get_user_data(window);
+
+  if (!ud)
+    return;
+
+  window_set_user_data(window, NULL);
+  menu_layer_destroy(ud->ml);
+  text_layer_destroy(ud->tl);
+  free(ud->entries);
+  free(ud->groups);
+  free(ud);
+}
+
+Window *
+dash_create(void)
+{
+  Window *w;
+
+  w = window_create();
+  window_set_window_handlers(w, (WindowHandlers) {
+    .load = load,
+    .appear = appear,
+    .disappear = disappear,
+    .unload = unload,
+  });
+
+  return w;
+}
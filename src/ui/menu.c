@@ -22,46 +22,144 @@
 #include "../token.h"
 #include "../libc.h"
 #include "code.h"
+#include "dash.h"
+
+#define SECTION_TOKENS 0
+#define SECTION_DASH   1
 
 typedef struct {
   int8_t from;
   int8_t to;
 } moving;
 
+/* What a row shows, kept in RAM so drawing never reads the store. */
+typedef struct {
+  char issuer[sizeof(((token *) 0)->issuer)];
+  char name[sizeof(((token *) 0)->name)];
+  uint32_t id;
+} row;
+
 typedef struct {
   MenuLayer *ml;
   TextLayer *tl;
   GBitmap *icon;
   Window *code;
+  Window *dash;
   moving moving;
+  row rows[TOKEN_MAX];
+  uint8_t nrows;
 } user_data;
 
+static bool
+contains(const uint32_t *ids, uint8_t n, uint32_t id)
+{
+  for (uint8_t i = 0; i < n; i++) {
+    if (ids[i] == id)
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Brings the rows in line with the store: rows of deleted tokens are
+ * dropped, the rest put in order, and only added tokens are read.
+ */
+static void
+rows_sync(user_data *ud)
+{
+  uint32_t ids[TOKEN_MAX];
+  uint8_t n = token_ids(ids);
+  uint8_t k = 0;
+  row tmp;
+
+  for (uint8_t i = 0; i < ud->nrows; i++) {
+    if (contains(ids, n, ud->rows[i].id))
+      ud->rows[k++] = ud->rows[i];
+  }
+  ud->nrows = k;
+
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t j = i;
+    token t;
+
+    while (j < ud->nrows && ud->rows[j].id != ids[i])
+      j++;
+
+    if (j < ud->nrows) {
+      tmp = ud->rows[i];
+      ud->rows[i] = ud->rows[j];
+      ud->rows[j] = tmp;
+      continue;
+    }
+
+    // Every row left is in ids, so there is room to insert.
+    memmove(&ud->rows[i + 1], &ud->rows[i], (ud->nrows - i) * sizeof(row));
+    ud->nrows++;
+
+    ud->rows[i] = (row) { .id = ids[i] };
+    if (token_get(i, &t)) {
+      memcpy(ud->rows[i].issuer, t.issuer, sizeof(t.issuer));
+      memcpy(ud->rows[i].name, t.name, sizeof(t.name));
+    }
+  }
+}
+
+static void
+rows_move(user_data *ud, int8_t from, int8_t to)
+{
+  row tmp = ud->rows[from];
+
+  if (from < to)
+    memmove(&ud->rows[from], &ud->rows[from + 1], (to - from) * sizeof(row));
+  else
+    memmove(&ud->rows[to + 1], &ud->rows[to], (from - to) * sizeof(row));
+
+  ud->rows[to] = tmp;
+}
+
 static void
 menu_draw_row(GContext *ctx, const Layer *cell_layer, MenuIndex *cell_index, void *callback_context)
 {
   user_data *ud = callback_context;
-  bool success;
-  token t;
+  int16_t i = cell_index->row;
+  const row *r;
+
+  if (cell_index->section == SECTION_DASH) {
+    menu_cell_basic_draw(ctx, cell_layer, "All codes", NULL, NULL);
+    return;
+  }
 
   if (ud->moving.to == cell_index->row)
-    success = token_get(ud->moving.from, &t);
+    i = ud->moving.from;
   else if (ud->moving.from < ud->moving.to && cell_index->row >= ud->moving.from && cell_index->row < ud->moving.to)
-    success = token_get(cell_index->row + 1, &t);
+    i = cell_index->row + 1;
   else if (ud->moving.from > ud->moving.to && cell_index->row > ud->moving.to && cell_index->row <= ud->moving.from)
-    success = token_get(cell_index->row - 1, &t);
-  else
-    success = token_get(cell_index->row, &t);
-  
-  if (success)
-    menu_cell_basic_draw(ctx, cell_layer, t.issuer, t.name, ud->moving.to == cell_index->row ? ud->icon : NULL);
+    i = cell_index->row - 1;
+
+  if (i < 0 || i >= ud->nrows)
+    return;
+
+  r = &ud->rows[i];
+  menu_cell_basic_draw(ctx, cell_layer, r->issuer, r->name, ud->moving.to == cell_index->row ? ud->icon : NULL);
+}
+
+static uint16_t
+menu_get_num_sections(MenuLayer *menu_layer, void *callback_context)
+{
+  return 2;
 }
 
 static uint16_t
 menu_get_num_rows(MenuLayer *menu_layer, uint16_t section_index, void *callback_context)
 {
   user_data *ud = callback_context;
-  uint16_t count = token_count();
-  
+  uint16_t count = ud->nrows;
+
+  // The dashboard is only worth a row when there are several tokens.
+  if (section_index == SECTION_DASH)
+    return count > 1 ? 1 : 0;
+
   layer_set_hidden(menu_layer_get_layer(ud->ml), count == 0);
   layer_set_hidden(text_layer_get_layer(ud->tl), count != 0);
   return count;
@@ -74,17 +172,24 @@ menu_select_click(MenuLayer *menu_layer, MenuIndex *cell_index, void *callback_c
   token t;
  
   if (ud->moving.from >= 0) {
-    if (ud->moving.from != ud->moving.to)
-      token_move(ud->moving.from, ud->moving.to);
+    if (ud->moving.from != ud->moving.to &&
+        token_move(ud->moving.from, ud->moving.to))
+      rows_move(ud, ud->moving.from, ud->moving.to);
     ud->moving = (moving) { -1, -1 };
     menu_layer_reload_data(menu_layer);
     return;
   }
 
-  if (token_get(cell_index->row, &t)) {
-    ud->code = code_create(&t);
-    if (ud->code)
-      window_stack_push(ud->code, true);
+  if (cell_index->section == SECTION_DASH) {
+    ud->dash = dash_create();
+    if (ud->dash)
+      window_stack_push(ud->dash, true);
+    return;
+  }
+
+  if (ud->code && token_get(cell_index->row, &t)) {
+    code_bind(ud->code, &t);
+    window_stack_push(ud->code, true);
   }
 }
 
@@ -92,7 +197,10 @@ static void
 menu_select_long_click(MenuLayer *menu_layer, MenuIndex *cell_index, void *callback_context)
 {
   user_data *ud = callback_context;
-  
+
+  if (ud->moving.from < 0 && cell_index->section == SECTION_DASH)
+    return;
+
   if (ud->moving.from < 0) {
     ud->moving = (moving) { (int8_t) cell_index->row, (int8_t) cell_index->row };
     menu_layer_reload_data(menu_layer);
@@ -106,6 +214,10 @@ menu_selection_changed(MenuLayer *menu_layer, MenuIndex new_index,
 {
   user_data *ud = callback_context;
 
+  if (old_index.section != SECTION_TOKENS ||
+      new_index.section != SECTION_TOKENS)
+    return;
+
   if (ud->moving.to == old_index.row) {
     ud->moving.to = new_index.row;
     menu_layer_reload_data(menu_layer);
@@ -128,6 +240,7 @@ load(Window *window)
   window_set_user_data(window, ud);
   
   ud->icon = gbitmap_create_with_resource(RESOURCE_ID_MOVE);
+  ud->code = code_create();
 
   ud->tl = text_layer_create(layer_get_bounds(rl));
   text_layer_set_text(ud->tl, "Use FreeOTP on your mobile device to add tokens.");
@@ -146,6 +259,7 @@ load(Window *window)
   menu_layer_set_click_config_onto_window(ud->ml, window);
   menu_layer_set_callbacks(ud->ml, ud, (MenuLayerCallbacks) {
     .draw_row = menu_draw_row,
+    .get_num_sections = menu_get_num_sections,
     .get_num_rows = menu_get_num_rows,
     .select_click = menu_select_click,
     .select_long_click = menu_select_long_click,
@@ -160,11 +274,13 @@ static void
 appear(Window *window)
 {
   user_data *ud = (user_data *) window_get_user_data(window);
-  if (ud->code) {
-    window_destroy(ud->code);
-    ud->code = NULL;
+
+  if (ud->dash) {
+    window_destroy(ud->dash);
+    ud->dash = NULL;
   }
 
+  rows_sync(ud);
   menu_layer_reload_data(ud->ml);
 }
 
@@ -176,6 +292,7 @@ unload(Window *window)
   menu_layer_destroy(ud->ml);
   text_layer_destroy(ud->tl);
   gbitmap_destroy(ud->icon);
+  code_destroy(ud->code);
   free(ud);
 }
 
@@ -198,5 +315,6 @@ void
 menu_reload(Window *window)
 {
   user_data *ud = window_get_user_data(window);
+  rows_sync(ud);
   menu_layer_reload_data(ud->ml);
 }
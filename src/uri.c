@@ -0,0 +1,562 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "uri.h"
+#include "libc.h"
+
+#include <string.h>
+
+/*
+ * Fields are split on any of "/?&=", skipping empty ones, just as strtok()
+ * would: the scheme, the type, the label and then parameter names and
+ * values in turn. Each is percent decoded on the way in.
+ */
+enum {
+  FIELD_NONE,
+  FIELD_SCHEME,
+  FIELD_TYPE,
+  FIELD_LABEL,
+  FIELD_PARAM,
+  FIELD_SECRET,
+  FIELD_ISSUER,
+  FIELD_ALGORITHM,
+  FIELD_DIGITS,
+  FIELD_COUNTER,
+  FIELD_PERIOD,
+  FIELD_OTHER,
+};
+
+static const struct {
+  const char *name;
+  uint8_t field;
+} params[] = {
+  { "secret", FIELD_SECRET },
+  { "issuer", FIELD_ISSUER },
+  { "algorithm", FIELD_ALGORITHM },
+  { "digits", FIELD_DIGITS },
+  { "counter", FIELD_COUNTER },
+  { "period", FIELD_PERIOD },
+  {}
+};
+
+/* The pieces of a written URI, each a string or number of some kind. */
+enum {
+  PIECE_LITERAL,
+  PIECE_UPPER,
+  PIECE_ESCAPED,
+  PIECE_SECRET,
+  PIECE_NUMBER,
+};
+
+static inline int8_t
+decode_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  return -1;
+}
+
+static void
+begin(uri_parser *p)
+{
+  if (p->fields < 3)
+    p->field = FIELD_SCHEME + p->fields;
+  else
+    p->field = p->fields == 3 ? FIELD_PARAM : p->param;
+
+  p->num = 0;
+  p->len = 0;
+  p->over = false;
+  p->split = false;
+
+  if (p->field == FIELD_LABEL || p->field == FIELD_ISSUER)
+    murmur3_init(&p->id);
+  else if (p->field == FIELD_SECRET)
+    base32_decode_init(&p->secret);
+}
+
+static void
+put(uri_parser *p, char c)
+{
+  token *t = p->token;
+
+  switch (p->field) {
+  case FIELD_LABEL:
+    // The id covers the whole label, "issuer:name".
+    murmur3_update(&p->id, &c, 1);
+    if (c == ':' && !p->split) {
+      memcpy(t->issuer, t->name, sizeof(t->issuer));
+      memset(t->name, 0, sizeof(t->name));
+      p->split = true;
+      p->len = 0;
+    } else if (p->len < sizeof(t->name) - 1) {
+      t->name[p->len++] = c;
+    }
+    break;
+
+  case FIELD_ISSUER:
+    murmur3_update(&p->id, &c, 1);
+    break;
+
+  case FIELD_SECRET:
+    if (base32_decode_update(&p->secret, &c, 1,
+                             t->secret, sizeof(t->secret)) < 0)
+      p->failed = true;
+    break;
+
+  case FIELD_COUNTER:
+  case FIELD_PERIOD:
+    // Like atoi(), stop at the first non-digit.
+    if (c < '0' || c > '9')
+      p->over = true;
+    else if (!p->over)
+      p->num = p->num * 10 + c - '0';
+    break;
+
+  case FIELD_OTHER:
+    break;
+
+  default:
+    if (p->len < sizeof(p->buf) - 1)
+      p->buf[p->len++] = c;
+    else
+      p->over = true;
+    break;
+  }
+}
+
+// An escape that isn't followed by two hex digits stands for itself.
+static void
+flush(uri_parser *p)
+{
+  uint8_t escape = p->escape;
+
+  p->escape = 0;
+  if (escape > 0)
+    put(p, '%');
+  if (escape > 1)
+    put(p, p->hex);
+}
+
+static void
+unescape(uri_parser *p, char c)
+{
+  int8_t l = decode_digit(c);
+
+  if (p->escape == 1 && l >= 0) {
+    p->hex = c;
+    p->escape = 2;
+    return;
+  }
+
+  // %00 is left alone, so a field never holds a NUL.
+  if (p->escape == 2 && l >= 0 && (decode_digit(p->hex) | l) != 0) {
+    p->escape = 0;
+    put(p, decode_digit(p->hex) << 4 | l);
+    return;
+  }
+
+  flush(p);
+  if (c == '%')
+    p->escape = 1;
+  else
+    put(p, c);
+}
+
+static void
+end(uri_parser *p)
+{
+  token *t = p->token;
+
+  flush(p);
+  if (p->len < sizeof(p->buf))
+    p->buf[p->len] = '\0';
+
+  switch (p->field) {
+  case FIELD_SCHEME:
+    if (p->over || __strcasecmp("otpauth:", p->buf) != 0)
+      p->failed = true;
+    break;
+
+  case FIELD_TYPE:
+    if (!p->over && __strcasecmp("totp", p->buf) == 0)
+      t->type = TOKEN_TYPE_TOTP;
+    else if (!p->over && __strcasecmp("hotp", p->buf) == 0)
+      t->type = TOKEN_TYPE_HOTP;
+    else
+      p->failed = true;
+    break;
+
+  case FIELD_LABEL:
+    t->id = murmur3_finish(&p->id);
+    break;
+
+  case FIELD_PARAM:
+    p->param = FIELD_OTHER;
+    for (size_t i = 0; !p->over && params[i].name; i++) {
+      if (strcmp(params[i].name, p->buf) == 0)
+        p->param = params[i].field;
+    }
+    break;
+
+  case FIELD_SECRET:
+    t->seclen = p->secret.count;
+    break;
+
+  case FIELD_ISSUER:
+    murmur3_update(&p->id, ":", 1);
+    murmur3_update(&p->id, t->name, strlen(t->name));
+    t->id = murmur3_finish(&p->id);
+    break;
+
+  case FIELD_ALGORITHM:
+    t->hash = p->over ? HASH_TYPE_UNKNOWN : hash_type_find(p->buf);
+    if (t->hash == HASH_TYPE_UNKNOWN)
+      t->hash = HASH_TYPE_SHA1;
+    break;
+
+  case FIELD_DIGITS:
+    if (!p->over && strcmp("8", p->buf) == 0)
+      t->digits = 8;
+    break;
+
+  case FIELD_COUNTER:
+    t->counter = p->num;
+    break;
+
+  case FIELD_PERIOD:
+    if (p->num != 0 && p->num <= UINT8_MAX)
+      t->period = p->num;
+    break;
+  }
+
+  p->field = FIELD_NONE;
+  p->fields = p->fields == 4 ? 3 : p->fields + 1;
+}
+
+void
+uri_init(uri_parser *p, token *t)
+{
+  memset(p, 0, sizeof(*p));
+  p->token = t;
+
+  // Set defaults.
+  memset(t, 0, sizeof(*t));
+  t->hash = HASH_TYPE_SHA1;
+  t->period = 30;
+  t->digits = 6;
+}
+
+bool
+uri_feed(uri_parser *p, const char *buf, size_t len)
+{
+  for (size_t i = 0; i < len && !p->done && !p->failed; i++) {
+    switch (buf[i]) {
+    case '\0': // The URI ends here, as a string would.
+      p->done = true;
+      break;
+
+    case '/':
+    case '?':
+    case '&':
+    case '=':
+      if (p->field != FIELD_NONE)
+        end(p);
+      break;
+
+    default:
+      if (p->field == FIELD_NONE)
+        begin(p);
+      unescape(p, buf[i]);
+      break;
+    }
+  }
+
+  return !p->failed;
+}
+
+bool
+uri_finish(uri_parser *p)
+{
+  if (!p->failed && p->field != FIELD_NONE)
+    end(p);
+
+  p->done = true;
+  p->token->kernel = hotp_kernel_find(p->token->hash, p->token->digits);
+
+  // The secret is required.
+  return !p->failed && p->token->seclen > 0;
+}
+
+static bool
+piece(const token *t, uint8_t i, uint8_t *kind, const char **str,
+      uint64_t *num)
+{
+  bool hotp = t->type == TOKEN_TYPE_HOTP;
+
+  *kind = PIECE_LITERAL;
+  switch (i) {
+  case 0:
+    *str = hotp ? "otpauth://hotp/" : "otpauth://totp/";
+    break;
+
+  case 1: // The label, "issuer:name".
+    *kind = PIECE_ESCAPED;
+    *str = t->issuer;
+    break;
+
+  case 2: // Also when a name alone would read as something else.
+    *str = t->issuer[0] != '\0' || t->name[0] == '\0' ||
+           strchr(t->name, ':') ? ":" : "";
+    break;
+
+  case 3:
+    *kind = PIECE_ESCAPED;
+    *str = t->name;
+    break;
+
+  case 4:
+    *str = "?secret=";
+    break;
+
+  case 5:
+    *kind = PIECE_SECRET;
+    break;
+
+  case 6:
+    *str = t->issuer[0] != '\0' ? "&issuer=" : "";
+    break;
+
+  case 7:
+    *kind = PIECE_ESCAPED;
+    *str = t->issuer;
+    break;
+
+  case 8:
+    *str = "&algorithm=";
+    break;
+
+  case 9:
+    *kind = PIECE_UPPER;
+    *str = hash_type_name(t->hash);
+    if (!*str)
+      *str = "sha1";
+    break;
+
+  case 10:
+    *str = "&digits=";
+    break;
+
+  case 11:
+    *kind = PIECE_NUMBER;
+    *num = t->digits;
+    break;
+
+  case 12:
+    *str = hotp ? "&counter=" : "&period=";
+    break;
+
+  case 13:
+    *kind = PIECE_NUMBER;
+    *num = hotp ? t->counter : t->period;
+    break;
+
+  default:
+    return false;
+  }
+
+  return true;
+}
+
+static inline bool
+unreserved(char c)
+{
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+         (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+         c == '~';
+}
+
+// Returns the number of characters written; *done once the piece is out.
+static size_t
+write_piece(uri_writer *w, uint8_t kind, const char *str, uint64_t num,
+            char *buf, size_t size, bool *done)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  const token *t = w->token;
+  size_t n = 0;
+
+  switch (kind) {
+  case PIECE_LITERAL:
+  case PIECE_UPPER:
+    for (; n < size && str[w->at] != '\0'; n++) {
+      char c = str[w->at++];
+      buf[n] = kind == PIECE_UPPER && c >= 'a' && c <= 'z' ? c - 32 : c;
+    }
+    *done = str[w->at] == '\0';
+    break;
+
+  case PIECE_ESCAPED:
+    for (; n < size && str[w->at] != '\0'; n++) {
+      uint8_t c = str[w->at];
+
+      if (unreserved(c)) {
+        buf[n] = c;
+        w->at++;
+        continue;
+      }
+
+      switch (w->escape++) {
+      case 0: buf[n] = '%'; break;
+      case 1: buf[n] = hex[c >> 4]; break;
+      default:
+        buf[n] = hex[c & 15];
+        w->escape = 0;
+        w->at++;
+        break;
+      }
+    }
+    *done = str[w->at] == '\0';
+    break;
+
+  case PIECE_SECRET: {
+    uint16_t len = (t->seclen * 8 + 4) / 5;
+
+    // All at once if it fits, else a digit at a time from its five bits.
+    if (w->at == 0 && size > len) {
+      base32_encode(t->secret, t->seclen, buf, size);
+      n = w->at = len;
+    }
+
+    for (; n < size && w->at < len; n++, w->at++) {
+      uint16_t bit = w->at * 5;
+      uint16_t v = t->secret[bit / 8] << 8;
+
+      if (bit / 8 + 1 < t->seclen)
+        v |= t->secret[bit / 8 + 1];
+      buf[n] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"[v >> (11 - bit % 8) & 31];
+    }
+    *done = w->at == len;
+    break;
+  }
+
+  case PIECE_NUMBER: {
+    char digits[20];
+    uint8_t len = 0;
+
+    do {
+      digits[len++] = '0' + num % 10;
+      num /= 10;
+    } while (num > 0);
+
+    for (; n < size && w->at < len; n++)
+      buf[n] = digits[len - 1 - w->at++];
+    *done = w->at == len;
+    break;
+  }
+  }
+
+  return n;
+}
+
+void
+uri_write_begin(uri_writer *w, const token *t)
+{
+  memset(w, 0, sizeof(*w));
+  w->token = t;
+}
+
+size_t
+uri_write(uri_writer *w, char *buf, size_t size)
+{
+  const char *str = NULL;
+  uint64_t num = 0;
+  uint8_t kind;
+  size_t n = 0;
+
+  while (n < size && piece(w->token, w->piece, &kind, &str, &num)) {
+    bool done = false;
+
+    n += write_piece(w, kind, str, num, buf + n, size - n, &done);
+    if (done) {
+      w->piece++;
+      w->at = 0;
+    }
+  }
+
+  return n;
+}
+
+size_t
+uri_format(const token *t, char *buf, size_t size)
+{
+  uri_writer w;
+  size_t n;
+
+  // The writer only stops short of size at the end of the URI.
+  uri_write_begin(&w, t);
+  n = uri_write(&w, buf, size);
+  if (n >= size)
+    return 0;
+
+  buf[n] = '\0';
+  return n;
+}
+
+void
+uri_dump_begin(uri_dump *d, uri_source source)
+{
+  memset(d, 0, sizeof(*d));
+  d->source = source;
+}
+
+size_t
+uri_dump_write(uri_dump *d, char *buf, size_t size)
+{
+  size_t n = 0;
+
+  while (n < size) {
+    size_t len;
+
+    if (!d->loaded) {
+      if (!d->source(d->pos, &d->token))
+        break;
+
+      uri_write_begin(&d->uri, &d->token);
+      d->loaded = true;
+    }
+
+    len = uri_write(&d->uri, buf + n, size - n);
+    n += len;
+    if (len == 0) {
+      buf[n++] = '\n';
+      d->loaded = false;
+      d->pos++;
+    }
+  }
+
+  return n;
+}
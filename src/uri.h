@@ -0,0 +1,104 @@
+/*
+ * FreeOTP
+ *
+ * Authors: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * Copyright (C) 2014  Nathaniel McCallum, Red Hat
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hash/murmur3.h"
+#include "base32.h"
+#include "token.h"
+
+/*
+ * A streaming otpauth URI parser. Input may arrive in any number of pieces;
+ * each byte is looked at once and decoded straight into the token, so
+ * nothing is copied or allocated.
+ */
+
+typedef struct {
+  token *token;
+  murmur3_ctx id;     /* Hash of the label, or of the issuer parameter. */
+  base32_ctx secret;
+  uint64_t num;       /* Value of a counter or period parameter. */
+  uint8_t fields;     /* Fields finished so far; parameters alternate 3, 4. */
+  uint8_t field;      /* What the current field is, if any. */
+  uint8_t param;      /* What the next field is, after a parameter name. */
+  uint8_t escape;     /* Characters of a pending %XX escape, and the first. */
+  char hex;
+  uint8_t len;        /* Short fields are collected in buf. */
+  char buf[10];
+  bool over;          /* The current field is too long, or not a number. */
+  bool split;         /* The label's issuer prefix has ended. */
+  bool failed;
+  bool done;
+} uri_parser;
+
+void
+uri_init(uri_parser *p, token *t);
+
+/* Parses len more bytes of the URI; false once it can't be a token. */
+bool
+uri_feed(uri_parser *p, const char *buf, size_t len);
+
+/* Ends the URI; true if it described a token. */
+bool
+uri_finish(uri_parser *p);
+
+/*
+ * Writes tokens back out as otpauth URIs, a piece at a time, so a URI can
+ * be produced in chunks of any size.
+ */
+
+typedef struct {
+  const token *token;
+  uint8_t piece;      /* The part of the URI being written, */
+  uint8_t escape;     /* the characters of its current %XX written, */
+  uint16_t at;        /* and how far into it. */
+} uri_writer;
+
+void
+uri_write_begin(uri_writer *w, const token *t);
+
+/* Writes up to size more bytes of the URI; returns 0 once it's all out. */
+size_t
+uri_write(uri_writer *w, char *buf, size_t size);
+
+/* Writes t's URI and a NUL; returns its length, or 0 if it won't fit. */
+size_t
+uri_format(const token *t, char *buf, size_t size);
+
+/* Gets the token at a position, as token_get() does. */
+typedef bool (*uri_source)(int8_t pos, token *t);
+
+/* Writes every token of a source as newline separated URIs. */
+typedef struct {
+  uri_source source;
+  uri_writer uri;
+  token token;
+  int8_t pos;
+  bool loaded;
+} uri_dump;
+
+void
+uri_dump_begin(uri_dump *d, uri_source source);
+
+/* Writes up to size more bytes of the dump; returns 0 at the end. */
+size_t
+uri_dump_write(uri_dump *d, char *buf, size_t size);
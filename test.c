@@ -1,10 +1,18 @@
 #include "src/hash/hmac.h"
+#include "src/hotp.h"
+#include "src/hash/murmur3.h"
+#include "src/pack.h"
+#include "src/token.h"
+#include "src/uri.h"
+#include "src/base32.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
 struct {
   hash_type type;
   const char *input;
@@ -114,6 +122,34 @@ struct {
   {}
 };
 
+struct {
+  hash_type type;
+  uint8_t digits;
+  const char *key;
+  uint64_t counter;
+  const char *output;
+} hotp_tests[] = {
+  { HASH_TYPE_SHA1, 6, "12345678901234567890", 0, "755224" },
+  { HASH_TYPE_SHA1, 6, "12345678901234567890", 1, "287082" },
+  { HASH_TYPE_SHA1, 6, "12345678901234567890", 5, "254676" },
+  { HASH_TYPE_SHA1, 6, "12345678901234567890", 9, "520489" },
+
+  { HASH_TYPE_SHA1, 8, "12345678901234567890", 1, "94287082" },
+  { HASH_TYPE_SHA1, 8, "12345678901234567890", 37037036, "07081804" },
+  { HASH_TYPE_SHA256, 8, "12345678901234567890123456789012",
+      1, "46119246" },
+  { HASH_TYPE_SHA256, 8, "12345678901234567890123456789012",
+      37037036, "68084774" },
+  { HASH_TYPE_SHA512, 8,
+      "1234567890123456789012345678901234567890123456789012345678901234",
+      1, "90693936" },
+  { HASH_TYPE_SHA512, 8,
+      "1234567890123456789012345678901234567890123456789012345678901234",
+      37037036, "25091201" },
+
+  {}
+};
+
 static char a[1000000];
 
 bool
@@ -172,6 +208,446 @@ test_hmac(__typeof__(*hmac_tests) *test)
   return true;
 }
 
+bool
+test_hotp(__typeof__(*hotp_tests) *test)
+{
+  hotp_kernel kernel = hotp_kernel_find(test->type, test->digits);
+  char generic[9] = {};
+  char special[9] = {};
+
+  if (!kernel)
+    return false;
+
+  kernel((const uint8_t *) test->key, strlen(test->key),
+         test->counter, special);
+  if (!hotp(test->type, test->digits,
+            (const uint8_t *) test->key, strlen(test->key),
+            test->counter, generic, sizeof(generic)))
+    return false;
+
+  if (strcmp(special, test->output) != 0 ||
+      strcmp(generic, test->output) != 0) {
+    fprintf(stderr, "%12s: %s / %llu\n", hash_type_name(test->type),
+            test->key, (unsigned long long) test->counter);
+    fprintf(stderr, "%12s: %s\n", "Expected", test->output);
+    fprintf(stderr, "%12s: %s\n", "Kernel", special);
+    fprintf(stderr, "%12s: %s\n\n", "Generic", generic);
+    return false;
+  }
+
+  return true;
+}
+
+bool
+test_murmur3(const char *input)
+{
+  size_t len = strlen(input);
+  char odd[len + 4];
+  murmur3_ctx ctx;
+
+  // Every split point must give the same answer as the one-shot hash.
+  for (size_t i = 0; i <= len; i++) {
+    murmur3_init(&ctx);
+    murmur3_update(&ctx, input, i);
+    murmur3_update(&ctx, input + i, len - i);
+    if (murmur3_finish(&ctx) != murmur3_32(input, len)) {
+      fprintf(stderr, "%12s: %s / %zu\n\n", "murmur3", input, i);
+      return false;
+    }
+  }
+
+  // Nor where it lies; message payloads are rarely aligned.
+  for (size_t i = 1; i < 4; i++) {
+    memcpy(odd + i, input, len);
+    if (murmur3_32(odd + i, len) != murmur3_32(input, len)) {
+      fprintf(stderr, "%12s: %s @ %zu\n\n", "murmur3", input, i);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+const char *uris[] = {
+  "otpauth://totp/Example:alice@google.com?secret=JBSWY3DPEHPK3PXP"
+    "&issuer=Example",
+  "otpauth://hotp/ACME%20Co:john.doe@email.com"
+    "?secret=HXDMVJECJJWSRB3HWIZR4IFUGFTMXBOZ&issuer=ACME%20Co"
+    "&algorithm=SHA1&digits=6&counter=0",
+  "otpauth://totp/Caf\xc3\xa9:b?secret=AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\notpauth://totp/Caf\xc3\xa9:c?secret=7",
+  NULL
+};
+
+struct {
+  const char *uri;
+  const char *label; /* What the id is a hash of; NULL if invalid. */
+  const char *issuer;
+  const char *name;
+  uint8_t seclen;
+  hash_type hash;
+  uint8_t digits;
+  uint8_t period;
+  uint64_t counter;
+} uri_tests[] = {
+  { "otpauth://totp/Example:alice@google.com?secret=JBSWY3DPEHPK3PXP"
+      "&issuer=Example",
+    "Example:alice@google.com", "Example", "alice@google.com",
+    10, HASH_TYPE_SHA1, 6, 30, 0 },
+  { "otpauth://hotp/john?secret=HXDMVJECJJWSRB3HWIZR4IFUGFTMXBOZ"
+      "&issuer=ACME%20Co&counter=4294967296",
+    "ACME Co:john", "", "john",
+    20, HASH_TYPE_SHA1, 6, 30, 4294967296 },
+  { "OTPAUTH://TOTP//a%3Ab%25%4%00:c?secret=ge-ze%2Dg&digits=8&period=60"
+      "&algorithm=sha256&foo=bar",
+    "a:b%%4%00:c", "a", "b%%4%00:c",
+    3, HASH_TYPE_SHA256, 8, 60, 0 },
+  { "otpauth://totp/a?secret=GE&digits=7&period=300&algorithm=rot13",
+    "a", "", "a",
+    1, HASH_TYPE_SHA1, 6, 30, 0 },
+  { .uri = "otpauth://totp/a?issuer=b" },
+  { .uri = "https://totp/a?secret=GE" },
+  { .uri = "otpauth://motp/a?secret=GE" },
+  { .uri = "otpauth://totp/a?secret=G!" },
+  {}
+};
+
+// Bit at a time, to check the table and vector codecs against.
+static void
+base32_reference(const uint8_t *data, int length, char *out)
+{
+  int n = 0;
+
+  for (int bit = 0; bit < length * 8; bit += 5, n++) {
+    int v = 0;
+
+    for (int i = bit; i < bit + 5; i++)
+      v = v << 1 | (i < length * 8 ? data[i / 8] >> (7 - i % 8) & 1 : 0);
+    out[n] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"[v];
+  }
+
+  out[n] = '\0';
+}
+
+bool
+test_base32(int length)
+{
+  static const char *separators[] = { " ", "-", "\t\r\n", " - " };
+  uint8_t data[128];
+  uint8_t back[128];
+  char expect[256];
+  char loose[256];
+  char enc[256];
+  int n;
+
+  for (int i = 0; i < length; i++)
+    data[i] = rand();
+
+  base32_reference(data, length, expect);
+  n = base32_encode(data, length, enc, sizeof(enc));
+  if (n != (int) strlen(expect) || strcmp(enc, expect) != 0)
+    goto error;
+
+  if (base32_decode(enc, back, sizeof(back)) != length ||
+      memcmp(back, data, length) != 0)
+    goto error;
+
+  // Lower case, mistyped digits and separators must decode the same
+  // wherever they fall.
+  for (int i = 0; i <= n; i++) {
+    const char *c = strchr("OLB", enc[i]);
+
+    loose[i] = enc[i];
+    if (c && rand() % 2)
+      loose[i] = "018"[c - "OLB"];
+    else if (enc[i] >= 'A' && enc[i] <= 'Z' && rand() % 2)
+      loose[i] = enc[i] | 0x20;
+  }
+  for (int i = 0; i <= n; i++) {
+    char spaced[300];
+
+    snprintf(spaced, sizeof(spaced), "%.*s%s%s", i, loose,
+             separators[i % 4], loose + i);
+    if (base32_decode(spaced, back, sizeof(back)) != length ||
+        memcmp(back, data, length) != 0)
+      goto error;
+
+    spaced[i] = '!';
+    if (n > 0 && base32_decode(spaced, back, sizeof(back)) != -1)
+      goto error;
+  }
+
+  return true;
+
+error:
+  fprintf(stderr, "%12s: %d bytes: %s\n\n", "base32", length, enc);
+  return false;
+}
+
+static bool
+parse(const char *uri, size_t len, size_t split, token *t)
+{
+  uri_parser p;
+
+  uri_init(&p, t);
+  uri_feed(&p, uri, split);
+  uri_feed(&p, uri + split, len - split);
+  return uri_finish(&p);
+}
+
+bool
+test_uri(__typeof__(*uri_tests) *test)
+{
+  size_t len = strlen(test->uri);
+  token whole;
+  token t;
+
+  if (!parse(test->uri, len, 0, &whole) != !test->label)
+    goto error;
+
+  if (test->label &&
+      (whole.id != murmur3_32(test->label, strlen(test->label)) ||
+       strcmp(whole.issuer, test->issuer) != 0 ||
+       strcmp(whole.name, test->name) != 0 ||
+       whole.seclen != test->seclen || whole.hash != test->hash ||
+       whole.digits != test->digits || whole.period != test->period ||
+       whole.counter != test->counter))
+    goto error;
+
+  // Nor may parsing depend on where the URI is split.
+  for (size_t i = 0; test->label && i <= len; i++) {
+    if (!parse(test->uri, len, i, &t) ||
+        memcmp(&t, &whole, sizeof(t)) != 0)
+      goto error;
+  }
+
+  return true;
+
+error:
+  fprintf(stderr, "%12s: %s\n\n", "uri", test->uri);
+  return false;
+}
+
+static bool
+source(int8_t pos, token *t)
+{
+  static token tokens[4];
+  static uint8_t used;
+
+  while (used < sizeof(tokens) / sizeof(*tokens) && uri_tests[used].label) {
+    parse(uri_tests[used].uri, strlen(uri_tests[used].uri), 0, &tokens[used]);
+    used++;
+  }
+
+  if (pos < 0 || pos >= used)
+    return false;
+
+  *t = tokens[pos];
+  return true;
+}
+
+bool
+test_format(__typeof__(*uri_tests) *test)
+{
+  char uri[512];
+  char chunked[512];
+  size_t len;
+  token a;
+  token b;
+
+  parse(test->uri, strlen(test->uri), 0, &a);
+  len = uri_format(&a, uri, sizeof(uri));
+  if (len == 0 || !parse(uri, len, 0, &b))
+    goto error;
+
+  // All but an id hashed from an issuer parameter must survive.
+  b.id = a.id;
+  if (memcmp(&a, &b, sizeof(a)) != 0 || uri_format(&a, uri, len) != 0)
+    goto error;
+
+  for (size_t chunk = 1; chunk <= len; chunk++) {
+    uri_writer w;
+    size_t pos = 0;
+    size_t n;
+
+    uri_write_begin(&w, &a);
+    while ((n = uri_write(&w, chunked + pos, MIN(chunk, len - pos))) > 0)
+      pos += n;
+    if (pos != len || memcmp(chunked, uri, len) != 0 ||
+        uri_write(&w, chunked, 1) != 0)
+      goto error;
+  }
+
+  return true;
+
+error:
+  fprintf(stderr, "%12s: %s\n\n", "format", test->uri);
+  return false;
+}
+
+bool
+test_dump(void)
+{
+  char expect[2048];
+  char out[2048];
+  size_t len = 0;
+  size_t pos = 0;
+  uri_dump d;
+  token t;
+  size_t n;
+
+  for (int8_t i = 0; source(i, &t); i++) {
+    len += uri_format(&t, expect + len, sizeof(expect) - len);
+    expect[len++] = '\n';
+  }
+
+  uri_dump_begin(&d, source);
+  while ((n = uri_dump_write(&d, out + pos, MIN(7, sizeof(out) - pos))) > 0)
+    pos += n;
+
+  if (pos != len || memcmp(out, expect, len) != 0) {
+    fprintf(stderr, "%12s: %.*s\n\n", "dump", (int) pos, out);
+    return false;
+  }
+
+  return true;
+}
+
+struct tlv {
+  uint8_t buf[512];
+  size_t len;
+  size_t ends[16]; /* Where each record ends. */
+  size_t n;
+};
+
+static void
+tlv_put(struct tlv *tlv, uint8_t tag, const void *value, size_t size)
+{
+  tlv->buf[tlv->len++] = tag;
+  tlv->buf[tlv->len++] = size;
+  memcpy(&tlv->buf[tlv->len], value, size);
+  tlv->len += size;
+  tlv->ends[tlv->n++] = tlv->len;
+}
+
+bool
+test_tlv(__typeof__(*uri_tests) *test)
+{
+  struct tlv tlv = {};
+  uint8_t counter[8];
+  token a;
+  token b;
+
+  parse(test->uri, strlen(test->uri), 0, &a);
+  for (size_t i = 0; i < sizeof(counter); i++)
+    counter[i] = a.counter >> (56 - i * 8);
+
+  // An unknown tag must be skipped, wherever it falls.
+  tlv_put(&tlv, 0x7f, "?", 1);
+  tlv_put(&tlv, TOKEN_TLV_TYPE, &a.type, 1);
+  tlv_put(&tlv, TOKEN_TLV_ISSUER, a.issuer, strlen(a.issuer));
+  tlv_put(&tlv, TOKEN_TLV_NAME, a.name, strlen(a.name));
+  tlv_put(&tlv, TOKEN_TLV_SECRET, a.secret, a.seclen);
+  tlv_put(&tlv, TOKEN_TLV_ALGORITHM, &a.hash, 1);
+  tlv_put(&tlv, TOKEN_TLV_DIGITS, &a.digits, 1);
+  tlv_put(&tlv, TOKEN_TLV_PERIOD, &a.period, 1);
+  tlv_put(&tlv, TOKEN_TLV_COUNTER, counter, sizeof(counter));
+
+  // All but an id hashed from an issuer parameter must survive.
+  if (!token_decode(tlv.buf, tlv.len, &b))
+    goto error;
+  b.id = a.id;
+  if (memcmp(&a, &b, sizeof(a)) != 0)
+    goto error;
+
+  // A record cut short anywhere fails the whole token.
+  for (size_t i = 0, r = 0; i < tlv.len; i++) {
+    if (i == tlv.ends[r])
+      r++;
+    else if (token_decode(tlv.buf, i, &b))
+      goto error;
+  }
+
+  return true;
+
+error:
+  fprintf(stderr, "%12s: %s\n\n", "tlv", test->uri);
+  return false;
+}
+
+bool
+test_tlv_limits(void)
+{
+  uint8_t value[100];
+  struct tlv tlv;
+  token t;
+
+  memset(value, 'a', sizeof(value));
+
+  // A secret longer than a token holds is refused, not cut short.
+  tlv = (struct tlv) {};
+  tlv_put(&tlv, TOKEN_TLV_SECRET, value, sizeof(t.secret));
+  if (!token_decode(tlv.buf, tlv.len, &t) || t.seclen != sizeof(t.secret))
+    goto error;
+  tlv_put(&tlv, TOKEN_TLV_SECRET, value, sizeof(t.secret) + 1);
+  if (token_decode(tlv.buf, tlv.len, &t))
+    goto error;
+
+  // As is a counter wider than 64 bits.
+  tlv = (struct tlv) {};
+  tlv_put(&tlv, TOKEN_TLV_SECRET, value, 10);
+  tlv_put(&tlv, TOKEN_TLV_COUNTER, value, sizeof(t.counter) + 1);
+  if (token_decode(tlv.buf, tlv.len, &t))
+    goto error;
+
+  // Strings are cut to fit.
+  tlv = (struct tlv) {};
+  tlv_put(&tlv, TOKEN_TLV_SECRET, value, 10);
+  tlv_put(&tlv, TOKEN_TLV_NAME, value, sizeof(value));
+  if (!token_decode(tlv.buf, tlv.len, &t) ||
+      strlen(t.name) != sizeof(t.name) - 1)
+    goto error;
+
+  // A length past the end of the buffer is truncation.
+  tlv.buf[1] = 11;
+  if (token_decode(tlv.buf, 12, &t))
+    goto error;
+
+  return true;
+
+error:
+  fprintf(stderr, "%12s: %zu bytes\n\n", "tlv", tlv.len);
+  return false;
+}
+
+bool
+test_pack(const char *uri)
+{
+  size_t len = strlen(uri);
+  uint8_t packed[512];
+  size_t size;
+
+  size = pack(uri, len, packed, sizeof(packed));
+  if (size == 0 || size >= len)
+    return false;
+
+  // Unpacking must not depend on where the stream is split.
+  for (size_t i = 0; i <= size; i++) {
+    pack_state st = {};
+    char out[512];
+    size_t pos = 0;
+
+    if (!unpack(&st, packed, i, out, &pos, len) ||
+        !unpack(&st, packed + i, size - i, out, &pos, len) ||
+        pos != len || memcmp(out, uri, len) != 0) {
+      fprintf(stderr, "%12s: %s / %zu\n\n", "pack", uri, i);
+      return false;
+    }
+  }
+
+  return true;
+}
+
 int
 main()
 {
@@ -187,5 +663,39 @@ main()
     if (!test_hmac(&hmac_tests[i]))
       ret++;
 
+  for (size_t i = 0; hotp_tests[i].output; i++)
+    if (!test_hotp(&hotp_tests[i]))
+      ret++;
+
+  for (size_t i = 0; tests[i].output; i++)
+    if (tests[i].input && !test_murmur3(tests[i].input))
+      ret++;
+
+  for (size_t i = 0; uris[i]; i++)
+    if (!test_pack(uris[i]))
+      ret++;
+
+  for (int i = 0; i <= 100; i++)
+    if (!test_base32(i))
+      ret++;
+
+  for (size_t i = 0; uri_tests[i].uri; i++)
+    if (!test_uri(&uri_tests[i]))
+      ret++;
+
+  for (size_t i = 0; uri_tests[i].uri; i++)
+    if (uri_tests[i].label && !test_format(&uri_tests[i]))
+      ret++;
+
+  if (!test_dump())
+    ret++;
+
+  for (size_t i = 0; uri_tests[i].uri; i++)
+    if (uri_tests[i].label && !test_tlv(&uri_tests[i]))
+      ret++;
+
+  if (!test_tlv_limits())
+    ret++;
+
   return ret;
 }